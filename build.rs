@@ -2,8 +2,21 @@ extern crate cc;
 use std::env;
 use std::process::{Command, Stdio};
 
+// cargo build --features webp,turbojpeg, links the system libwebp and libturbojpeg
+fn enable_codecs(build: &mut cc::Build) {
+    if env::var("CARGO_FEATURE_WEBP").is_ok() {
+        build.define("ENABLE_WEBP", None);
+        println!("cargo:rustc-link-lib=webp");
+    }
+    if env::var("CARGO_FEATURE_TURBOJPEG").is_ok() {
+        build.define("ENABLE_TURBOJPEG", None);
+        println!("cargo:rustc-link-lib=turbojpeg");
+    }
+}
+
 fn build_win_msvc() {
-    cc::Build::new()
+    let mut build = cc::Build::new();
+    build
         .cpp(true)
         .flag("-Zi")
         .flag("-Gm")
@@ -17,7 +30,9 @@ fn build_win_msvc() {
         .file("./src/shp23dtile.cpp")
         .file("./src/osgb23dtile.cpp")
         .file("./src/dxt_img.cpp")
-        .compile("_3dtile");
+        .file("./src/img_encoder.cpp");
+    enable_codecs(&mut build);
+    build.compile("_3dtile");
     // -------------
     println!("cargo:rustc-link-search=native=./lib");
     // -------------
@@ -43,7 +58,8 @@ fn build_win_msvc() {
 }
 
 fn build_win_gun() {
-    cc::Build::new()
+    let mut build = cc::Build::new();
+    build
         .cpp(true)
         .flag("-std=c++11")
         .warnings(false)
@@ -54,7 +70,9 @@ fn build_win_gun() {
         .file("./src/shp23dtile.cpp")
         .file("./src/osgb23dtile.cpp")
         .file("./src/dxt_img.cpp")
-        .compile("_3dtile");
+        .file("./src/img_encoder.cpp");
+    enable_codecs(&mut build);
+    build.compile("_3dtile");
     // -------------
     println!("cargo:rustc-link-search=native=./lib");
     // -------------
@@ -79,7 +97,8 @@ fn build_win_gun() {
 }
 
 fn build_linux_unkonw() {
-    cc::Build::new()
+    let mut build = cc::Build::new();
+    build
         .cpp(true)
         .flag("-std=c++11")
         .warnings(false)
@@ -89,7 +108,9 @@ fn build_linux_unkonw() {
         .file("./src/shp23dtile.cpp")
         .file("./src/osgb23dtile.cpp")
         .file("./src/dxt_img.cpp")
-        .compile("_3dtile");
+        .file("./src/img_encoder.cpp");
+    enable_codecs(&mut build);
+    build.compile("_3dtile");
     // -------------
     println!("cargo:rustc-link-search=native=./lib");
     // -------------
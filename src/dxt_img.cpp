@@ -1,4 +1,5 @@
 #include <vector>
+#include <algorithm>
 #include <osg/Image>
 using namespace std;
 
@@ -81,6 +82,66 @@ void resize_Image(vector<unsigned char>& jpeg_buf, int width, int height, int ne
     jpeg_buf = new_buf;
 }
 
+// one axis of resample_image: the source pixels [begin, end) each target pixel covers,
+// weighted by how much of them it covers
+struct Footprint {
+    int begin;
+    vector<float> weight;
+};
+
+vector<Footprint> area_footprints(int size, int new_size) {
+    vector<Footprint> fp(new_size);
+    double scale = (double)size / new_size;
+    for (int i = 0; i < new_size; i++) {
+        double x0 = i * scale;
+        double x1 = std::min((double)size, (i + 1) * scale);
+        fp[i].begin = (int)x0;
+        for (int x = fp[i].begin; x < x1; x++) {
+            double w = std::min(x1, x + 1.0) - std::max(x0, (double)x);
+            fp[i].weight.push_back((float)(w / scale));
+        }
+    }
+    return fp;
+}
+
+/**
+ * box filter resampling, each target pixel is the area weighted mean of the
+ * source pixels under it, it keeps the detail nearest sampling drops
+*/
+void resample_image(const unsigned char* buf, int row_stride, int width, int height, int comp,
+    vector<unsigned char>& out, int new_w, int new_h) {
+    vector<Footprint> fx = area_footprints(width, new_w);
+    vector<Footprint> fy = area_footprints(height, new_h);
+    // rows first, then columns
+    vector<float> rows(new_w * height * comp);
+    for (int y = 0; y < height; y++) {
+        const unsigned char* src = buf + y * row_stride;
+        float* dst = rows.data() + y * new_w * comp;
+        for (int x = 0; x < new_w; x++) {
+            for (size_t k = 0; k < fx[x].weight.size(); k++) {
+                const unsigned char* p = src + (fx[x].begin + k) * comp;
+                for (int c = 0; c < comp; c++) {
+                    dst[x * comp + c] += p[c] * fx[x].weight[k];
+                }
+            }
+        }
+    }
+    out.resize(new_w * new_h * comp);
+    vector<float> acc(new_w * comp);
+    for (int y = 0; y < new_h; y++) {
+        std::fill(acc.begin(), acc.end(), 0.0f);
+        for (size_t k = 0; k < fy[y].weight.size(); k++) {
+            const float* src = rows.data() + (fy[y].begin + k) * new_w * comp;
+            for (int i = 0; i < new_w * comp; i++) {
+                acc[i] += src[i] * fy[y].weight[k];
+            }
+        }
+        for (int i = 0; i < new_w * comp; i++) {
+            out[y * new_w * comp + i] = (unsigned char)std::min(255.0f, acc[i] + 0.5f);
+        }
+    }
+}
+
 void fill_4BitImage(vector<unsigned char>& jpeg_buf, osg::Image* img, int& width, int& height) {
     jpeg_buf.resize(width * height * 3);
     unsigned char* pData = img->data();
@@ -123,7 +184,10 @@ void fill_4BitImage(vector<unsigned char>& jpeg_buf, osg::Image* img, int& width
             y_pos += 4;
         }
     }
-    int max_size = 2048;
+}
+
+// halve the rgb image until it fits max_size
+void shrink_image(vector<unsigned char>& jpeg_buf, int& width, int& height, int max_size) {
     if (width > max_size || height > max_size) {
         int new_w = width, new_h = height;
         while (new_w > max_size || new_h > max_size)
@@ -3,4 +3,9 @@
 
 void fill_4BitImage(std::vector<unsigned char>& jpeg_buf, osg::Image* img, int& width, int& height);
 
+void shrink_image(std::vector<unsigned char>& jpeg_buf, int& width, int& height, int max_size);
+
+void resample_image(const unsigned char* buf, int row_stride, int width, int height, int comp,
+    std::vector<unsigned char>& out, int new_w, int new_h);
+
 #endif
\ No newline at end of file
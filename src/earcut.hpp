@@ -108,13 +108,30 @@ private:
             return object;
         }
         void reset(std::size_t newBlockSize) {
+            newBlockSize = std::max<std::size_t>(1, newBlockSize);
+            // keep the first block when the Earcut object is reused
+            if (!allocations.empty() && newBlockSize <= blockSize) {
+                rewind();
+                return;
+            }
+            clear();
+            blockSize = newBlockSize;
+            currentIndex = blockSize;
+        }
+        // drop the objects, keeping the first block for the next polygon
+        void rewind() {
+            if (allocations.empty()) return;
+            for (std::size_t i = 1; i < allocations.size(); i++) alloc.deallocate(allocations[i], blockSize);
+            allocations.resize(1);
+            currentBlock = allocations[0];
+            currentIndex = 0;
+        }
+        void clear() {
             for (auto allocation : allocations) alloc.deallocate(allocation, blockSize);
             allocations.clear();
-            blockSize = std::max<std::size_t>(1, newBlockSize);
             currentBlock = nullptr;
             currentIndex = blockSize;
         }
-        void clear() { reset(blockSize); }
     private:
         T* currentBlock = nullptr;
         std::size_t currentIndex = 1;
@@ -175,7 +192,7 @@ void Earcut<N>::operator()(const Polygon& points) {
 
     earcutLinked(outerNode);
 
-    nodes.clear();
+    nodes.rewind();
 }
 
 // create a circular doubly linked list from polygon points in the specified winding order
@@ -61,6 +61,25 @@ bool write_tileset(
 	const char* filename, const char* full_path
 	) ;
 
+// tile of the shapefile quadtree, keep the same as ShpTile in shape.rs
+struct ShpTile
+{
+	int z;
+	int x;
+	int y;
+	double geometric_error;
+	double region[6];
+	double transform[16];
+	// empty if the tile has no content
+	char uri[64];
+};
+
+void tile_region(
+	double longti, double lati,
+	double tile_w, double tile_h,
+	double height_min, double height_max,
+	double* region, double* matrix);
+
 extern "C" {
 	double degree2rad(double val);
 	double lati_to_meter(double diff);
@@ -1,23 +1,152 @@
+extern crate flate2;
+
+use std::fs;
+use std::fs::File;
+use std::io;
+use std::io::prelude::*;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+use fun_c::flate2::write::GzEncoder;
+use fun_c::flate2::Compression;
+
+/// how the output files are written
+#[derive(Clone, Copy, PartialEq)]
+pub enum Compress {
+    None = 0,
+    /// gzip the file in place, the server sends `Content-Encoding: gzip`
+    Gzip = 1,
+    /// keep the file and write a `.gz` next to it, e.g. nginx `gzip_static`
+    GzipSidecar = 2,
+}
+
+static COMPRESS: AtomicUsize = AtomicUsize::new(0);
+
+pub fn set_compress(mode: Compress) {
+    COMPRESS.store(mode as usize, Ordering::SeqCst);
+}
+
+pub fn get_compress() -> Compress {
+    match COMPRESS.load(Ordering::SeqCst) {
+        1 => Compress::Gzip,
+        2 => Compress::GzipSidecar,
+        _ => Compress::None,
+    }
+}
+
+fn gzip(buf: &[u8]) -> io::Result<Vec<u8>> {
+    let mut e = GzEncoder::new(Vec::with_capacity(buf.len() / 2), Compression::default());
+    e.write_all(buf)?;
+    e.finish()
+}
+
+/// write every output file (tiles, tileset json, subtrees) through here,
+/// so it is compressed by the thread which made it
+pub fn write_output(path: &Path, buf: &[u8]) -> io::Result<()> {
+    match get_compress() {
+        Compress::None => File::create(path)?.write_all(buf),
+        Compress::Gzip => File::create(path)?.write_all(&gzip(buf)?),
+        Compress::GzipSidecar => {
+            File::create(path)?.write_all(buf)?;
+            let mut gz_path = path.as_os_str().to_owned();
+            gz_path.push(".gz");
+            File::create(gz_path)?.write_all(&gzip(buf)?)
+        }
+    }
+}
+
+/// an output file written as it is made, compressed the same as write_output
+pub enum OutputWriter {
+    Plain(io::BufWriter<File>),
+    Gzip(GzEncoder<io::BufWriter<File>>),
+    GzipSidecar(io::BufWriter<File>, GzEncoder<io::BufWriter<File>>),
+}
+
+pub fn create_output(path: &Path) -> io::Result<OutputWriter> {
+    let create = |path: &Path| File::create(path).map(io::BufWriter::new);
+    Ok(match get_compress() {
+        Compress::None => OutputWriter::Plain(create(path)?),
+        Compress::Gzip => OutputWriter::Gzip(GzEncoder::new(create(path)?, Compression::default())),
+        Compress::GzipSidecar => {
+            let mut gz_path = path.as_os_str().to_owned();
+            gz_path.push(".gz");
+            OutputWriter::GzipSidecar(
+                create(path)?,
+                GzEncoder::new(create(Path::new(&gz_path))?, Compression::default()),
+            )
+        }
+    })
+}
+
+impl OutputWriter {
+    /// end the gzip streams and flush, the errors of a drop are lost
+    pub fn finish(self) -> io::Result<()> {
+        match self {
+            OutputWriter::Plain(mut w) => w.flush(),
+            OutputWriter::Gzip(e) => e.finish()?.flush(),
+            OutputWriter::GzipSidecar(mut w, e) => {
+                w.flush()?;
+                e.finish()?.flush()
+            }
+        }
+    }
+}
+
+impl Write for OutputWriter {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        match *self {
+            OutputWriter::Plain(ref mut w) => w.write(buf),
+            OutputWriter::Gzip(ref mut e) => e.write(buf),
+            OutputWriter::GzipSidecar(ref mut w, ref mut e) => {
+                w.write_all(buf)?;
+                e.write_all(buf)?;
+                Ok(buf.len())
+            }
+        }
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        match *self {
+            OutputWriter::Plain(ref mut w) => w.flush(),
+            OutputWriter::Gzip(ref mut e) => e.flush(),
+            OutputWriter::GzipSidecar(ref mut w, ref mut e) => {
+                w.flush()?;
+                e.flush()
+            }
+        }
+    }
+}
+
+/// write next to path and rename it over, a reader never sees half a file
+pub fn replace_output(path: &Path, buf: &[u8]) -> io::Result<()> {
+    let mut tmp = path.as_os_str().to_owned();
+    tmp.push(".tmp");
+    let tmp = PathBuf::from(tmp);
+    write_output(&tmp, buf)?;
+    if get_compress() == Compress::GzipSidecar {
+        let mut gz_tmp = tmp.as_os_str().to_owned();
+        gz_tmp.push(".gz");
+        let mut gz_path = path.as_os_str().to_owned();
+        gz_path.push(".gz");
+        fs::rename(gz_tmp, gz_path)?;
+    }
+    fs::rename(tmp, path)
+}
+
 #[no_mangle]
 pub extern "C" fn write_file(file_name: *const i8, buf: *const u8, buf_len: u32) -> bool {
     use std::ffi;
-    use std::fs::File;
-    use std::io::prelude::*;
     use std::slice;
 
     unsafe {
         if let Ok(file_name) = ffi::CStr::from_ptr(file_name).to_str() {
-            if let Ok(mut f) = File::create(file_name) {
-                let arr = slice::from_raw_parts(buf, buf_len as usize);
-                match f.write_all(arr) {
-                    Ok(_) => true,
-                    Err(e) => {
-                        error!("{}", e);
-                        false
-                    }
+            let arr = slice::from_raw_parts(buf, buf_len as usize);
+            match write_output(Path::new(file_name), arr) {
+                Ok(_) => true,
+                Err(e) => {
+                    error!("{}", e);
+                    false
                 }
-            } else {
-                false
             }
         } else {
             error!("convert file_name fail");
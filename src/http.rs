@@ -0,0 +1,123 @@
+//! a minimal HTTP/1.1 server for the local APIs, one thread per connection
+
+use std::io;
+use std::io::prelude::*;
+use std::io::BufReader;
+use std::net::{TcpListener, TcpStream};
+use std::sync::Arc;
+use std::thread;
+
+// the largest request body, the APIs only take small json jobs
+const MAX_BODY: usize = 1 << 20;
+
+pub struct Request {
+    pub method: String,
+    /// without the query
+    pub path: String,
+    pub body: Vec<u8>,
+}
+
+// None if the body is above MAX_BODY, it is not read
+fn read_request(stream: &TcpStream) -> io::Result<Option<Request>> {
+    let mut reader = BufReader::new(stream);
+    let mut line = String::new();
+    reader.read_line(&mut line)?;
+    let mut parts = line.split_whitespace();
+    let method = parts.next().unwrap_or("").to_string();
+    let target = parts.next().unwrap_or("/").to_string();
+    let mut content_length = 0;
+    loop {
+        line.clear();
+        if reader.read_line(&mut line)? == 0 || line.trim().is_empty() {
+            break;
+        }
+        let mut kv = line.splitn(2, ':');
+        let key = kv.next().unwrap_or("").trim().to_lowercase();
+        if key == "content-length" {
+            content_length = kv.next().unwrap_or("").trim().parse().unwrap_or(0);
+        }
+    }
+    if content_length > MAX_BODY {
+        return Ok(None);
+    }
+    let mut body = vec![0u8; content_length];
+    reader.read_exact(&mut body)?;
+    let path = match target.find('?') {
+        Some(p) => target[..p].to_string(),
+        None => target,
+    };
+    Ok(Some(Request {
+        method: method,
+        path: path,
+        body: body,
+    }))
+}
+
+fn status_text(status: u16) -> &'static str {
+    match status {
+        200 => "OK",
+        201 => "Created",
+        400 => "Bad Request",
+        404 => "Not Found",
+        405 => "Method Not Allowed",
+        413 => "Payload Too Large",
+        _ => "Internal Server Error",
+    }
+}
+
+pub fn respond(
+    stream: &mut TcpStream,
+    status: u16,
+    content_type: &str,
+    headers: &[(&str, &str)],
+    body: &[u8],
+) -> io::Result<()> {
+    let mut head = format!(
+        "HTTP/1.1 {} {}\r\nContent-Type: {}\r\nContent-Length: {}\r\nConnection: close\r\n",
+        status,
+        status_text(status),
+        content_type,
+        body.len()
+    );
+    for &(k, v) in headers {
+        head += &format!("{}: {}\r\n", k, v);
+    }
+    head += "\r\n";
+    stream.write_all(head.as_bytes())?;
+    stream.write_all(body)?;
+    stream.flush()
+}
+
+pub fn respond_json(stream: &mut TcpStream, status: u16, val: &::serde_json::Value) -> io::Result<()> {
+    respond(stream, status, "application/json", &[], val.to_string().as_bytes())
+}
+
+/// serve until the listener fails, handler answers one request per connection
+pub fn serve<F>(addr: &str, handler: F) -> io::Result<()>
+where
+    F: Fn(Request, &mut TcpStream) -> io::Result<()> + Send + Sync + 'static,
+{
+    let listener = TcpListener::bind(addr)?;
+    info!("listen on http://{}", addr);
+    let handler = Arc::new(handler);
+    for stream in listener.incoming() {
+        let mut stream = match stream {
+            Ok(s) => s,
+            Err(e) => {
+                error!("accept: {}", e);
+                continue;
+            }
+        };
+        let handler = handler.clone();
+        thread::spawn(move || {
+            let ret = read_request(&stream).and_then(|req| match req {
+                Some(req) => handler(req, &mut stream),
+                None => respond(&mut stream, 413, "text/plain", &[], b"request body too large"),
+            });
+            if let Err(e) = ret {
+                error!("http: {}", e);
+            }
+        });
+    }
+    Ok(())
+}
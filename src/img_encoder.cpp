@@ -0,0 +1,137 @@
+#include <cstring>
+
+#include "img_encoder.h"
+#include "stb_image_write.h"
+
+#ifdef ENABLE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
+#ifdef ENABLE_WEBP
+#include <webp/encode.h>
+#endif
+
+static void append_buf(void* context, void* data, int len) {
+    std::vector<unsigned char>* buf = (std::vector<unsigned char>*)context;
+    buf->insert(buf->end(), (unsigned char*)data, (unsigned char*)data + len);
+}
+
+class StbJpegEncoder : public ImageEncoder
+{
+public:
+    const char* name() const { return "stb"; }
+
+    bool encode(const unsigned char* pixels, int width, int height, int comp,
+        int row_stride, int quality, std::vector<unsigned char>& out)
+    {
+        // stb takes packed rows only
+        std::vector<unsigned char> packed;
+        if (row_stride != width * comp) {
+            packed.resize(width * height * comp);
+            for (int y = 0; y < height; y++) {
+                memcpy(packed.data() + y * width * comp, pixels + y * row_stride, width * comp);
+            }
+            pixels = packed.data();
+        }
+        out.reserve(out.size() + width * height * comp / 8);
+        return stbi_write_jpg_to_func(append_buf, &out, width, height, comp, pixels, quality) != 0;
+    }
+};
+
+#ifdef ENABLE_TURBOJPEG
+class TurboJpegEncoder : public ImageEncoder
+{
+    // a compressor per thread, tjhandle is not thread safe
+    struct Handle
+    {
+        tjhandle tj;
+        Handle() : tj(tjInitCompress()) {}
+        ~Handle() { if (tj) tjDestroy(tj); }
+    };
+
+public:
+    const char* name() const { return "libjpeg-turbo"; }
+
+    bool encode(const unsigned char* pixels, int width, int height, int comp,
+        int row_stride, int quality, std::vector<unsigned char>& out)
+    {
+        static thread_local Handle handle;
+        int format = comp == 1 ? TJPF_GRAY : comp == 3 ? TJPF_RGB : comp == 4 ? TJPF_RGBA : -1;
+        if (!handle.tj || format < 0) {
+            return false;
+        }
+        unsigned char* jpeg = NULL;
+        unsigned long size = 0;
+        int ret = tjCompress2(handle.tj, (unsigned char*)pixels, width, row_stride, height, format,
+            &jpeg, &size, comp == 1 ? TJSAMP_GRAY : TJSAMP_420, quality, TJFLAG_FASTDCT);
+        if (ret == 0) {
+            out.insert(out.end(), jpeg, jpeg + size);
+        }
+        tjFree(jpeg);
+        return ret == 0;
+    }
+};
+#endif
+
+#ifdef ENABLE_WEBP
+class WebpEncoder : public ImageEncoder
+{
+    bool lossless;
+
+public:
+    WebpEncoder(bool _lossless) : lossless(_lossless) {}
+
+    const char* name() const { return lossless ? "libwebp lossless" : "libwebp"; }
+
+    bool encode(const unsigned char* pixels, int width, int height, int comp,
+        int row_stride, int quality, std::vector<unsigned char>& out)
+    {
+        // webp takes rgb or rgba
+        std::vector<unsigned char> rgb;
+        if (comp == 1) {
+            rgb.resize(width * height * 3);
+            for (int y = 0; y < height; y++) {
+                for (int x = 0; x < width; x++) {
+                    unsigned char v = pixels[y * row_stride + x];
+                    rgb[3 * (y * width + x)] = rgb[3 * (y * width + x) + 1] = rgb[3 * (y * width + x) + 2] = v;
+                }
+            }
+            pixels = rgb.data();
+            row_stride = width * 3;
+            comp = 3;
+        }
+        uint8_t* webp = NULL;
+        size_t size = 0;
+        if (comp == 3) {
+            size = lossless
+                ? WebPEncodeLosslessRGB(pixels, width, height, row_stride, &webp)
+                : WebPEncodeRGB(pixels, width, height, row_stride, quality, &webp);
+        }
+        else if (comp == 4) {
+            size = lossless
+                ? WebPEncodeLosslessRGBA(pixels, width, height, row_stride, &webp)
+                : WebPEncodeRGBA(pixels, width, height, row_stride, quality, &webp);
+        }
+        if (size) {
+            out.insert(out.end(), webp, webp + size);
+        }
+        WebPFree(webp);
+        return size != 0;
+    }
+};
+#endif
+
+ImageEncoder* image_encoder(int format) {
+#ifdef ENABLE_TURBOJPEG
+    static TurboJpegEncoder jpeg;
+#else
+    static StbJpegEncoder jpeg;
+#endif
+#ifdef ENABLE_WEBP
+    static WebpEncoder webp(false);
+    static WebpEncoder webp_lossless(true);
+    if (format == TEX_WEBP) return &webp;
+    if (format == TEX_WEBP_LOSSLESS) return &webp_lossless;
+#endif
+    return format == TEX_JPEG ? &jpeg : NULL;
+}
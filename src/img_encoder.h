@@ -0,0 +1,36 @@
+#ifndef IMG_ENCODER_H
+#define IMG_ENCODER_H
+
+#include <vector>
+
+enum TexFormat
+{
+    TEX_JPEG = 0,
+    TEX_WEBP = 1,
+    TEX_WEBP_LOSSLESS = 2
+};
+
+/**
+ * encodes the pixel rows, row_stride bytes apart, of 1 gray, 3 rgb or 4 rgba
+ * components, the rows of an osg::Image are passed as they are
+*/
+class ImageEncoder
+{
+public:
+    virtual ~ImageEncoder() {}
+
+    virtual const char* name() const = 0;
+
+    // appends the file to out, false if the pixels are not supported
+    virtual bool encode(const unsigned char* pixels, int width, int height, int comp,
+        int row_stride, int quality, std::vector<unsigned char>& out) = 0;
+};
+
+/**
+ * the encoder of the format, NULL if it is not built in:
+ * jpeg is libjpeg-turbo with ENABLE_TURBOJPEG, else stb_image_write,
+ * webp is libwebp with ENABLE_WEBP
+*/
+ImageEncoder* image_encoder(int format);
+
+#endif
@@ -10,8 +10,11 @@ extern crate chrono;
 extern crate env_logger;
 
 pub mod fun_c;
+mod http;
 mod osgb;
+mod serve;
 mod shape;
+mod tile_server;
 
 use chrono::prelude::*;
 use serde::{Deserialize};
@@ -56,7 +59,7 @@ fn main() {
                 .long("input")
                 .value_name("FILE")
                 .help("Set the input file")
-                .required(true)
+                .required_unless("serve")
                 .takes_value(true),
         )
         .arg(
@@ -65,7 +68,7 @@ fn main() {
                 .long("output")
                 .value_name("FILE")
                 .help("Set the out file")
-                .required(true)
+                .required_unless("serve")
                 .takes_value(true),
         )
         .arg(
@@ -74,7 +77,7 @@ fn main() {
                 .long("format")
                 .value_name("osgb,shape,gltf,b3dm")
                 .help("Set input format")
-                .required(true)
+                .required_unless("serve")
                 .takes_value(true),
         )
         .arg(
@@ -88,7 +91,23 @@ fn main() {
     \"y\": y,
     \"offset\": 0,
     \"max_lvl\" : 20,
-    \"pbr\" : false
+    \"pbr\" : false,
+    \"mem_budget\" : 65536 (MB),
+    \"progressive\" : false,
+    \"workers\" : 8,
+    \"worker_jobs\" : 50,
+    \"worker_rss\" : 8192 (MB),
+    \"retries\" : 1,
+    \"mem_cache\" : 1024 (MB),
+    \"disk_cache\" : 65536 (MB),
+    \"texture_cache\" : 256 (MB),
+    \"texture_sse\" : 16,
+    \"texture_crop\" : false,
+    \"texture_atlas\" : false,
+    \"texture_format\" : \"jpeg\" | \"webp\" | \"webp_lossless\",
+    \"texture_quality\" : 80,
+    \"texture_fallback\" : false,
+    \"normals\" : \"auto\" | \"none\" | \"keep\" | \"generate\"
 }",
                 )
                 .takes_value(true),
@@ -99,6 +118,69 @@ fn main() {
                 .help("Set the shapefile height field")
                 .takes_value(true),
         )
+        .arg(
+            Arg::with_name("fields")
+                .long("fields")
+                .help("Set the shapefile fields written to the batch table, * for all")
+                .takes_value(true),
+        )
+        .arg(
+            Arg::with_name("implicit")
+                .long("implicit")
+                .help("Write the shapefile quadtree as 3D Tiles 1.1 implicit tiling")
+                .takes_value(false),
+        )
+        .arg(
+            Arg::with_name("glb")
+                .long("glb")
+                .help("Write glb tile content (3D Tiles 1.1) instead of b3dm")
+                .takes_value(false),
+        )
+        .arg(
+            Arg::with_name("compress")
+                .long("compress")
+                .value_name("gzip,gz")
+                .help(
+                    "Write the output precompressed:
+gzip: compress in place, serve with Content-Encoding: gzip
+gz: keep the output and write .gz files next to it",
+                )
+                .takes_value(true),
+        )
+        .arg(
+            Arg::with_name("shard")
+                .long("shard")
+                .value_name("i/n")
+                .help("Convert the i-th (from 0) of n shards of the osgb Tile_, merge them with --merge")
+                .takes_value(true),
+        )
+        .arg(
+            Arg::with_name("jobs")
+                .long("jobs")
+                .value_name("FILE")
+                .help("Convert only the osgb Tile_ listed in the file, one name per line")
+                .takes_value(true),
+        )
+        .arg(
+            Arg::with_name("merge")
+                .long("merge")
+                .help("Make the root tileset.json from the partial results of the shards")
+                .takes_value(false),
+        )
+        .arg(
+            Arg::with_name("serve")
+                .long("serve")
+                .value_name("ADDR")
+                .help("Keep running and convert the jobs posted to http://ADDR/jobs, e.g. 127.0.0.1:8730")
+                .takes_value(true),
+        )
+        .arg(
+            Arg::with_name("tile-server")
+                .long("tile-server")
+                .value_name("ADDR")
+                .help("Serve the osgb input as 3D Tiles on http://ADDR, converting tiles on request, the output is the cache dir")
+                .takes_value(true),
+        )
         .arg(
             Arg::with_name("verbose")
                 .short("v")
@@ -108,11 +190,30 @@ fn main() {
         )
         .get_matches();
 
+    let compress = matches.value_of("compress").unwrap_or("");
+    if !set_compress(compress) {
+        return;
+    }
+    if let Some(addr) = matches.value_of("serve") {
+        if let Err(e) = serve::run(addr, run_job) {
+            error!("serve {} failed: {}", addr, e);
+        }
+        return;
+    }
     let input = matches.value_of("input").unwrap();
     let output = matches.value_of("output").unwrap();
     let format = matches.value_of("format").unwrap();
     let tile_config = matches.value_of("config").unwrap_or("");
     let height_field = matches.value_of("height").unwrap_or("");
+    let batch_fields = matches.value_of("fields").unwrap_or("");
+    let implicit = matches.is_present("implicit");
+    let glb = matches.is_present("glb");
+    let shard = OsgbShard {
+        shard: matches.value_of("shard").unwrap_or(""),
+        jobs: matches.value_of("jobs").unwrap_or(""),
+        merge: matches.is_present("merge"),
+    };
+    let tile_server = matches.value_of("tile-server");
 
     if matches.is_present("verbose") {
         info!("set program versose on");
@@ -122,12 +223,17 @@ fn main() {
         error!("{} does not exists.", input);
         return;
     }
+    write_encoding_marker(output);
     match format {
         "osgb" => {
-            convert_osgb(input, output, tile_config);
+            convert_osgb(input, output, tile_config, glb, compress, &shard, tile_server, None);
+        }
+        "osgb-worker" => {
+            // started by the worker pool of convert_osgb
+            osgb::osgb_worker();
         }
         "shape" => {
-            convert_shapefile(input, output, height_field);
+            convert_shapefile(input, output, height_field, batch_fields, implicit, glb);
         }
         "gltf" => {
             convert_gltf(input, output);
@@ -141,6 +247,83 @@ fn main() {
     }
 }
 
+fn set_compress(compress: &str) -> bool {
+    match compress {
+        "" => {}
+        "gzip" => fun_c::set_compress(fun_c::Compress::Gzip),
+        "gz" => fun_c::set_compress(fun_c::Compress::GzipSidecar),
+        _ => {
+            error!("compress must be gzip or gz: {}", compress);
+            return false;
+        }
+    }
+    true
+}
+
+// tell the deploy step every file needs Content-Encoding: gzip
+fn write_encoding_marker(output: &str) {
+    if fun_c::get_compress() != fun_c::Compress::Gzip {
+        return;
+    }
+    let marker = std::path::Path::new(output).join(".content-encoding");
+    if let Err(e) = std::fs::create_dir_all(output)
+        .and_then(|_| std::fs::write(&marker, "gzip"))
+    {
+        error!("write {} failed: {}", marker.display(), e);
+    }
+}
+
+// a job of --serve, the fields are named like the command line options
+fn run_job(job: &serde_json::Value, progress: std::sync::Arc<osgb::Progress>) -> bool {
+    let get = |key: &str| job[key].as_str().unwrap_or("");
+    let input = get("input");
+    let output = get("output");
+    let glb = job["glb"].as_bool().unwrap_or(false);
+    if !std::path::Path::new(input).exists() {
+        error!("{} does not exists.", input);
+        return false;
+    }
+    write_encoding_marker(output);
+    match get("format") {
+        "osgb" => {
+            // the config is the -c json, as an object or a string
+            let config = match job["config"] {
+                serde_json::Value::String(ref s) => s.clone(),
+                serde_json::Value::Null => String::new(),
+                ref v => v.to_string(),
+            };
+            let shard = OsgbShard {
+                shard: get("shard"),
+                jobs: get("jobs"),
+                merge: job["merge"].as_bool().unwrap_or(false),
+            };
+            let compress = match fun_c::get_compress() {
+                fun_c::Compress::Gzip => "gzip",
+                fun_c::Compress::GzipSidecar => "gz",
+                fun_c::Compress::None => "",
+            };
+            convert_osgb(input, output, &config, glb, compress, &shard, None, Some(progress))
+        }
+        "shape" => {
+            progress.total.store(1, std::sync::atomic::Ordering::SeqCst);
+            let ret = convert_shapefile(
+                input,
+                output,
+                get("height"),
+                get("fields"),
+                job["implicit"].as_bool().unwrap_or(false),
+                glb,
+            );
+            progress.done.store(1, std::sync::atomic::Ordering::SeqCst);
+            ret
+        }
+        format => {
+            error!("format not support in serve: {}", format);
+            false
+        }
+    }
+}
+
 fn convert_b3dm(src: &str, dest: &str) {
     use std::fs::File;
     use std::io::prelude::*;
@@ -214,7 +397,24 @@ struct ModelMetadata {
     pub SRSOrigin: String,
 }
 
-fn convert_osgb(src: &str, dest: &str, config: &str) {
+// how the osgb conversion is split over several machines
+struct OsgbShard<'a> {
+    shard: &'a str,
+    jobs: &'a str,
+    merge: bool,
+}
+
+// with a tile_server address the tiles are served on demand instead of converted
+fn convert_osgb(
+    src: &str,
+    dest: &str,
+    config: &str,
+    glb: bool,
+    compress: &str,
+    shard: &OsgbShard,
+    tile_server: Option<&str>,
+    progress: Option<std::sync::Arc<osgb::Progress>>,
+) -> bool {
     use serde_json::Value;
     use std::fs::File;
     use std::io::prelude::*;
@@ -225,9 +425,9 @@ fn convert_osgb(src: &str, dest: &str, config: &str) {
 
     let mut center_x = 0f64;
     let mut center_y = 0f64;
-    let mut max_lvl = None;
-    let mut trans_region = None;
-    let mut pbr_texture  = false;
+    let mut osgb_config = osgb::OsgbConfig::default();
+    osgb_config.glb_content = glb;
+    osgb_config.progress = progress;
 
     // try parse metadata.xml
     let metadata_file = dir.join("metadata.xml");
@@ -356,38 +556,132 @@ fn convert_osgb(src: &str, dest: &str, config: &str) {
             center_y = y;
         }
         if let Some(h) = v["offset"].as_f64() {
-            trans_region = Some(h);
+            osgb_config.region_offset = Some(h);
         }
         if let Some(lvl) = v["max_lvl"].as_i64() {
-            max_lvl = Some(lvl as i32);
+            osgb_config.max_lvl = Some(lvl as i32);
         }
         if let Some(pbr) = v["pbr"].as_bool() {
-            pbr_texture = pbr;
+            osgb_config.pbr_texture = pbr;
+        }
+        if let Some(mb) = v["mem_budget"].as_u64() {
+            osgb_config.mem_budget = Some(mb << 20);
+        }
+        if let Some(p) = v["progressive"].as_bool() {
+            osgb_config.progressive = p;
+        }
+        if let Some(mb) = v["mem_cache"].as_u64() {
+            osgb_config.mem_cache = Some(mb << 20);
+        }
+        if let Some(mb) = v["disk_cache"].as_u64() {
+            osgb_config.disk_cache = Some(mb << 20);
+        }
+        if let Some(mb) = v["texture_cache"].as_u64() {
+            osgb_config.texture_cache = Some(mb << 20);
+        }
+        if let Some(sse) = v["texture_sse"].as_f64() {
+            osgb_config.texture_sse = Some(sse);
+        }
+        if let Some(crop) = v["texture_crop"].as_bool() {
+            osgb_config.texture_crop = crop;
+        }
+        if let Some(atlas) = v["texture_atlas"].as_bool() {
+            osgb_config.texture_atlas = atlas;
+        }
+        if let Some(format) = v["texture_format"].as_str() {
+            osgb_config.texture_format = Some(format.to_string());
+        }
+        if let Some(q) = v["texture_quality"].as_i64() {
+            osgb_config.texture_quality = Some(q as i32);
+        }
+        if let Some(fallback) = v["texture_fallback"].as_bool() {
+            osgb_config.texture_fallback = fallback;
+        }
+        if let Some(normals) = v["normals"].as_str() {
+            osgb_config.normals = Some(normals.to_string());
+        }
+        if let Some(n) = v["workers"].as_u64() {
+            let mut args = vec![];
+            if !compress.is_empty() {
+                args.push("--compress".to_string());
+                args.push(compress.to_string());
+            }
+            osgb_config.pool = Some(osgb::PoolConfig {
+                workers: n as usize,
+                max_jobs: v["worker_jobs"].as_u64().unwrap_or(50) as usize,
+                max_rss: v["worker_rss"].as_u64().map(|mb| mb << 20),
+                retries: v["retries"].as_u64().unwrap_or(1) as usize,
+                args: args,
+            });
         }
     } else if config.len() > 0 {
         error!("config error --> {}", config);
     }
+    if !shard.jobs.is_empty() {
+        match std::fs::read_to_string(shard.jobs) {
+            Ok(list) => {
+                osgb_config.job_list = Some(
+                    list.lines()
+                        .map(|l| l.trim().to_string())
+                        .filter(|l| !l.is_empty())
+                        .collect(),
+                );
+            }
+            Err(e) => {
+                error!("read {} failed: {}", shard.jobs, e);
+                return false;
+            }
+        }
+        let stem = std::path::Path::new(shard.jobs).file_stem().unwrap();
+        osgb_config.partial = Some(format!("jobs_{}", stem.to_string_lossy()));
+    } else if !shard.shard.is_empty() {
+        let v: Vec<usize> = shard.shard.split("/").filter_map(|x| x.parse().ok()).collect();
+        if v.len() != 2 || v[0] >= v[1] {
+            error!("shard must be i/n with i < n: {}", shard.shard);
+            return false;
+        }
+        osgb_config.shard = Some((v[0], v[1]));
+        osgb_config.partial = Some(format!("shard_{}_{}", v[0], v[1]));
+    }
+    if let Some(addr) = tile_server {
+        let ret = tile_server::run(addr, &dir, &dir_dest, center_x, center_y, &osgb_config);
+        if let Err(e) = ret {
+            error!("tile server {} failed: {}", addr, e);
+        }
+        return false;
+    }
     let tick = time::SystemTime::now();
-    if let Err(e) = osgb::osgb_batch_convert(
-                        &dir, &dir_dest, max_lvl,
-                        center_x, center_y, trans_region, pbr_texture)
+    let ret = if shard.merge {
+        osgb::osgb_merge(&dir_dest, center_x, center_y, &osgb_config)
+    } else {
+        osgb::osgb_batch_convert(&dir, &dir_dest, center_x, center_y, &osgb_config)
+    };
+    if let Err(e) = ret
     {
         error!("{}", e);
-        return;
+        return false;
     }
     let elap_sec = tick.elapsed().unwrap();
     let tick_num = elap_sec.as_secs() as f64 + elap_sec.subsec_nanos() as f64 * 1e-9;
     info!("task over, cost {:.2} s.", tick_num);
+    true
 }
 
-fn convert_shapefile(src: &str, dest: &str, height: &str) {
+fn convert_shapefile(
+    src: &str,
+    dest: &str,
+    height: &str,
+    fields: &str,
+    implicit: bool,
+    glb: bool,
+) -> bool {
     if height.is_empty() {
         error!("you must set the height field by --height xxx");
-        return;
+        return false;
     }
     let tick = std::time::SystemTime::now();
 
-    let ret = shape::shape_batch_convert(src, dest, height);
+    let ret = shape::shape_batch_convert(src, dest, height, fields, implicit, glb);
     if !ret {
         error!("convert shapefile failed");
     } else {
@@ -395,4 +689,5 @@ fn convert_shapefile(src: &str, dest: &str, height: &str) {
         let tick_num = elap_sec.as_secs() as f64 + elap_sec.subsec_nanos() as f64 * 1e-9;
         info!("task over, cost {:.2} s.", tick_num);
     }
+    ret
 }
@@ -7,8 +7,22 @@ use std::fs;
 
 use osgb::rayon::prelude::*;
 
+use std::collections::{HashMap, HashSet};
+use std::env;
 use std::error::Error;
-use std::path::Path;
+use std::fs::OpenOptions;
+use std::io;
+use std::io::prelude::*;
+use std::io::BufReader;
+use std::path::{Path, PathBuf};
+use std::process::{Child, ChildStdin, ChildStdout, Command, Stdio};
+use std::ptr;
+use std::slice;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+use std::time::Instant;
+
+use fun_c::replace_output;
 
 extern "C" {
 
@@ -20,10 +34,46 @@ extern "C" {
         x: f64,
         y: f64,
         max_lvl: i32,
-        pbr_texture: bool
+        pbr_texture: bool,
+        glb_content: bool,
+        peak_mem: *mut u64
+    ) -> *mut libc::c_void;
+
+    fn osgb23dtile_open(name_in: *const u8) -> *mut libc::c_void;
+
+    fn osgb23dtile_close(tree: *mut libc::c_void);
+
+    fn osgb23dtile_next_level(tree: *mut libc::c_void, lvl: i32) -> i32;
+
+    fn osgb23dtile_level(
+        tree: *mut libc::c_void,
+        name_in: *const u8,
+        name_out: *const u8,
+        box_ptr: *mut f64,
+        len: *mut i32,
+        x: f64,
+        y: f64,
+        lvl: i32,
+        pbr_texture: bool,
+        glb_content: bool,
+        peak_mem: *mut u64
     ) -> *mut libc::c_void;
 
     pub fn osgb2glb(name_in: *const u8, name_out: *const u8) -> bool;
+
+    fn osgb_texture_cache(capacity: u64);
+
+    fn osgb_texture_options(sse: f64, crop: bool, atlas: bool);
+
+    fn osgb_texture_format(format: i32, quality: i32, fallback: bool);
+
+    fn osgb_texture_cache_stats(hits: *mut u64, misses: *mut u64);
+
+    fn osgb_mesh_options(normals: i32);
+
+    fn osgb_task_threads(threads: u32);
+
+    fn osgb_mesh_stats(bytes_in: *mut u64, bytes_out: *mut u64);
  
 	fn transform_c(radian_x: f64, radian_y: f64, height_min: f64, ptr: *mut f64);
 
@@ -56,33 +106,309 @@ struct TileResult {
 struct OsgbInfo {
     in_dir: String,
     out_dir: String,
-    sender: ::std::sync::mpsc::Sender<TileResult>,
+    // Tile_xx_xx, the key of the cost model
+    name: String,
+    // the largest osgb of the Tile_ dir, the job memory grows with it
+    max_file: u64,
+    max_path: PathBuf,
+    // osgb bytes plus the per file overhead
+    size: f64,
+    // estimated seconds, the longest jobs are started first
+    cost: f64,
 }
 
-pub fn osgb_batch_convert(
-    dir: &Path,
-    dir_dest: &Path,
-    max_lvl: Option<i32>,
-    center_x: f64,
-    center_y: f64,
-    region_offset: Option<f64>,
-    pbr_texture: bool,
-) -> Result<(), Box<dyn Error>> {
-    use std::fs::File;
-    use std::io::prelude::*;
-    use std::sync::mpsc::channel;
+/// the tile config of osgb_batch_convert
+#[derive(Default)]
+pub struct OsgbConfig {
+    pub max_lvl: Option<i32>,
+    pub region_offset: Option<f64>,
+    pub pbr_texture: bool,
+    pub glb_content: bool,
+    /// RAM budget in bytes shared by the running jobs
+    pub mem_budget: Option<u64>,
+    /// convert all the Tile_ level by level, coarse to fine
+    pub progressive: bool,
+    /// convert in worker processes instead of threads
+    pub pool: Option<PoolConfig>,
+    /// convert the i-th of n shards of the Tile_
+    pub shard: Option<(usize, usize)>,
+    /// convert only these Tile_
+    pub job_list: Option<Vec<String>>,
+    /// with a shard or job list, the result goes to partial/<name>.json
+    /// and osgb_merge makes the root tileset
+    pub partial: Option<String>,
+    /// counts the finished Tile_ jobs
+    pub progress: Option<Arc<Progress>>,
+    /// memory and disk cache of the tile server, in bytes
+    pub mem_cache: Option<u64>,
+    pub disk_cache: Option<u64>,
+    /// the encoded textures shared by the tiles, in bytes, 0 disables it
+    pub texture_cache: Option<u64>,
+    /// the screen-space error the client refines at, limits the texture size per tile
+    pub texture_sse: Option<f64>,
+    /// crop the textures to the uv bounds of each tile
+    pub texture_crop: bool,
+    /// pack the textures of each tile in atlases
+    pub texture_atlas: bool,
+    /// jpeg, webp or webp_lossless
+    pub texture_format: Option<String>,
+    /// the jpeg and webp quality, 0 to 100
+    pub texture_quality: Option<i32>,
+    /// a jpeg image next to each webp one
+    pub texture_fallback: bool,
+    /// auto, none, keep or generate
+    pub normals: Option<String>,
+}
 
-    let path = dir.join("Data");
-    // .\Data directory
-    if !path.exists() || !path.is_dir() {
-        return Err(From::from(format!("dir {} not exist", path.display())));
+/// the Tile_ jobs done of total, read by the serve status
+#[derive(Default)]
+pub struct Progress {
+    pub total: AtomicUsize,
+    pub done: AtomicUsize,
+}
+
+impl OsgbConfig {
+    fn add_total(&self, n: usize) {
+        if let Some(ref p) = self.progress {
+            p.total.fetch_add(n, Ordering::SeqCst);
+        }
     }
 
-    let (sender, receiver) = channel();
+    fn add_done(&self) {
+        if let Some(ref p) = self.progress {
+            p.done.fetch_add(1, Ordering::SeqCst);
+        }
+    }
+}
+
+/// the worker processes are this program run with `-f osgb-worker`,
+/// a crash or exit() in the converter only loses the worker
+#[derive(Clone)]
+pub struct PoolConfig {
+    pub workers: usize,
+    /// restart a worker after this many jobs, osg plugins leak
+    pub max_jobs: usize,
+    /// restart a worker when its RSS is above this many bytes
+    pub max_rss: Option<u64>,
+    /// how often a job crashing its worker is retried before quarantine
+    pub retries: usize,
+    /// passed on to the workers, e.g. --compress
+    pub args: Vec<String>,
+}
+
+// total size, largest size and count of the osgb files under dir,
+// and the path of the largest
+fn scan_osgb_files(dir: &Path) -> (u64, u64, usize, PathBuf) {
+    let mut total = 0;
+    let mut max = 0;
+    let mut count = 0;
+    let mut max_path = PathBuf::new();
+    if let Ok(entries) = fs::read_dir(dir) {
+        for entry in entries.filter_map(|e| e.ok()) {
+            let path = entry.path();
+            if path.is_dir() {
+                let (t, m, c, p) = scan_osgb_files(&path);
+                total += t;
+                if m > max {
+                    max = m;
+                    max_path = p;
+                }
+                count += c;
+            } else if path.extension().map_or(false, |e| e == "osgb") {
+                let len = entry.metadata().map(|m| m.len()).unwrap_or(0);
+                total += len;
+                if len > max {
+                    max = len;
+                    max_path = path;
+                }
+                count += 1;
+            }
+        }
+    }
+    (total, max, count, max_path)
+}
+
+fn be16(buf: &[u8], i: usize) -> u64 {
+    (buf[i] as u64) << 8 | buf[i + 1] as u64
+}
+
+fn be32(buf: &[u8], i: usize) -> u64 {
+    be16(buf, i) << 16 | be16(buf, i + 2)
+}
+
+fn le32(buf: &[u8], i: usize) -> u64 {
+    (0..4).fold(0, |v, k| v | (buf[i + k] as u64) << (8 * k))
+}
+
+// width x height of the jpeg at i, from its SOF segment
+fn jpeg_size(buf: &[u8], mut i: usize) -> Option<(u64, u64)> {
+    i += 2;
+    while i + 9 < buf.len() && buf[i] == 0xFF {
+        let marker = buf[i + 1];
+        match marker {
+            // SOF0 to SOF15, not DHT, JPG and DAC
+            m if m >= 0xC0 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC => {
+                return Some((be16(buf, i + 7), be16(buf, i + 5)));
+            }
+            0xDA => return None,
+            _ => i += 2 + be16(buf, i + 2) as usize,
+        }
+    }
+    None
+}
+
+/// the decoded bytes (RGBA) of the jpeg, png and dds images embedded in an
+/// osgb, read from their headers: an 8K jpeg of a few MB is 256 MB decoded,
+/// which the file size does not tell
+pub fn texture_bytes(path: &Path) -> u64 {
+    let buf = match fs::read(path) {
+        Ok(buf) => buf,
+        Err(_) => return 0,
+    };
+    let mut bytes = 0;
+    let mut i = 0;
+    while i + 24 < buf.len() {
+        let size = if buf[i] == 0xFF && buf[i + 1] == 0xD8 && buf[i + 2] == 0xFF {
+            jpeg_size(&buf, i)
+        } else if &buf[i..i + 8] == b"\x89PNG\r\n\x1a\n" && &buf[i + 12..i + 16] == b"IHDR" {
+            Some((be32(&buf, i + 16), be32(&buf, i + 20)))
+        } else if &buf[i..i + 4] == b"DDS " {
+            Some((le32(&buf, i + 16), le32(&buf, i + 12)))
+        } else {
+            None
+        };
+        if let Some((w, h)) = size {
+            bytes += w * h * 4;
+        }
+        i += 1;
+    }
+    bytes
+}
+
+// file name of the cost model, kept in the output dir between runs
+const COST_MODEL_FILE: &str = ".cost_model.json";
+// reading and parsing one more osgb costs as much as this many bytes
+const FILE_OVERHEAD_BYTES: f64 = 65536.0;
+
+// seconds per Tile_ of the last run, and the seconds per byte they imply
+struct CostModel {
+    seconds: HashMap<String, f64>,
+    sec_per_byte: f64,
+}
+
+impl CostModel {
+    fn load(dir_dest: &Path) -> CostModel {
+        let mut model = CostModel {
+            seconds: HashMap::new(),
+            sec_per_byte: 0.0,
+        };
+        let val: serde_json::Value = match fs::read(dir_dest.join(COST_MODEL_FILE))
+            .ok()
+            .and_then(|buf| serde_json::from_slice(&buf).ok())
+        {
+            Some(v) => v,
+            None => return model,
+        };
+        model.sec_per_byte = val["sec_per_byte"].as_f64().unwrap_or(0.0);
+        if let Some(tiles) = val["tiles"].as_object() {
+            for (k, v) in tiles {
+                if let Some(sec) = v.as_f64() {
+                    model.seconds.insert(k.clone(), sec);
+                }
+            }
+        }
+        model
+    }
+
+    fn size(total_bytes: u64, file_count: usize) -> f64 {
+        total_bytes as f64 + file_count as f64 * FILE_OVERHEAD_BYTES
+    }
+
+    // the measured time of the last run, else a size based guess
+    fn estimate(&self, name: &str, size: f64) -> f64 {
+        match self.seconds.get(name) {
+            Some(&sec) => sec,
+            None if self.sec_per_byte > 0.0 => size * self.sec_per_byte,
+            // no history, the order is all that matters
+            None => size * 1e-8,
+        }
+    }
+
+    fn save(dir_dest: &Path, timing: &[(String, f64, f64)]) -> Result<(), Box<dyn Error>> {
+        let mut tiles = serde_json::Map::new();
+        let mut sec_sum = 0.0;
+        let mut size_sum = 0.0;
+        for &(ref name, size, sec) in timing {
+            tiles.insert(name.clone(), json!(sec));
+            sec_sum += sec;
+            size_sum += size;
+        }
+        let sec_per_byte = if size_sum > 0.0 { sec_sum / size_sum } else { 0.0 };
+        let val = json!({
+            "sec_per_byte": sec_per_byte,
+            "tiles": tiles
+        });
+        fs::write(dir_dest.join(COST_MODEL_FILE), serde_json::to_vec(&val)?)?;
+        Ok(())
+    }
+}
+
+// admit the jobs only while their estimated memory fits into the budget
+pub struct MemBudget {
+    budget: u64,
+    used: Mutex<u64>,
+    cond: Condvar,
+    // peak memory besides the decoded textures / largest osgb,
+    // learned from the finished jobs
+    ratio: Mutex<f64>,
+}
+
+impl MemBudget {
+    pub fn new(budget: Option<u64>) -> MemBudget {
+        MemBudget {
+            budget: budget.unwrap_or(u64::max_value()),
+            used: Mutex::new(0),
+            cond: Condvar::new(),
+            // the dxt textures and the meshes, they are many times bigger
+            // decoded. the jpeg and png textures are counted from their sizes
+            ratio: Mutex::new(12.0),
+        }
+    }
+
+    /// textures is texture_bytes of the largest osgb
+    pub fn estimate(&self, max_file: u64, textures: u64) -> u64 {
+        (max_file as f64 * *self.ratio.lock().unwrap()) as u64 + textures
+    }
+
+    // block until the job fits, a job larger than the budget runs alone
+    pub fn acquire(&self, need: u64) -> u64 {
+        let need = need.min(self.budget);
+        let mut used = self.used.lock().unwrap();
+        while *used + need > self.budget {
+            used = self.cond.wait(used).unwrap();
+        }
+        *used += need;
+        need
+    }
+
+    pub fn release(&self, admitted: u64, max_file: u64, textures: u64, peak: u64) {
+        if max_file > 0 && peak > textures {
+            let mut ratio = self.ratio.lock().unwrap();
+            *ratio = ratio.max((peak - textures) as f64 / max_file as f64);
+        }
+        *self.used.lock().unwrap() -= admitted;
+        self.cond.notify_all();
+    }
+}
+
+// the Tile_ directories of dir/Data, the most expensive first
+fn plan_jobs(
+    path: &Path,
+    dir_dest: &Path,
+    cost_model: &CostModel,
+) -> Result<Vec<OsgbInfo>, Box<dyn Error>> {
     let mut osgb_dir_pair: Vec<OsgbInfo> = vec![];
-    let mut task_count = 0;
-    fs::create_dir_all(dir_dest)?;
-    for entry in fs::read_dir(&path)? {
+    for entry in fs::read_dir(path)? {
         let entry = entry?;
         let path_tile = entry.path();
         if path_tile.is_dir() {
@@ -91,72 +417,887 @@ pub fn osgb_batch_convert(
             let osgb = path_tile.join(stem).with_extension("osgb");
             if osgb.exists() && !osgb.is_dir() {
                 // convert this path
-                task_count += 1;
-                //let in_buf = str_to_vec_c(osgb.to_str().unwrap());
                 let out_dir = dir_dest.join("Data").join(stem);
-                fs::create_dir_all(&out_dir)?;
+                let (total_bytes, max_file, file_count, max_path) = scan_osgb_files(&path_tile);
+                let size = CostModel::size(total_bytes, file_count);
                 osgb_dir_pair.push(OsgbInfo {
                     in_dir: osgb.to_string_lossy().into(),
                     out_dir: out_dir.to_string_lossy().into(),
-                    sender: sender.clone(),
+                    name: stem.into(),
+                    max_file: max_file,
+                    max_path: max_path,
+                    size: size,
+                    cost: cost_model.estimate(stem, size),
                 });
             } else {
                 error!("dir error: {}", osgb.display());
             }
         }
     }
+    // longest processing time first, a big Tile_ started last is the tail of the run
+    osgb_dir_pair.sort_by(|a, b| b.cost.partial_cmp(&a.cost).unwrap());
+    Ok(osgb_dir_pair)
+}
+
+// the Tile_ of this shard or job list, every machine must get the same split,
+// so it only depends on the osgb sizes and names, not on the cost model
+fn select_jobs(jobs: Vec<OsgbInfo>, config: &OsgbConfig) -> Vec<OsgbInfo> {
+    if let Some(ref list) = config.job_list {
+        return jobs.into_iter().filter(|info| list.contains(&info.name)).collect();
+    }
+    let (shard, count) = match config.shard {
+        Some(v) => v,
+        None => return jobs,
+    };
+    let mut order: Vec<usize> = (0..jobs.len()).collect();
+    order.sort_by(|&a, &b| {
+        jobs[b]
+            .size
+            .partial_cmp(&jobs[a].size)
+            .unwrap()
+            .then_with(|| jobs[a].name.cmp(&jobs[b].name))
+    });
+    // the biggest Tile_ to the lightest shard
+    let mut load = vec![0f64; count];
+    let mut owner = vec![0usize; jobs.len()];
+    for i in order {
+        let mut min = 0;
+        for s in 1..count {
+            if load[s] < load[min] {
+                min = s;
+            }
+        }
+        load[min] += jobs[i].size;
+        owner[i] = min;
+    }
+    jobs.into_iter()
+        .enumerate()
+        .filter(|&(i, _)| owner[i] == shard)
+        .map(|(_, info)| info)
+        .collect()
+}
+
+// the workers take the jobs in order, par_iter would split the list instead,
+// f gets the index of the worker running it
+fn dispatch_in_order<T: Send, F: Fn(usize, &mut T) + Sync>(jobs: &mut [T], f: F) {
+    let slots: Vec<Mutex<&mut T>> = jobs.iter_mut().map(Mutex::new).collect();
+    let next_job = AtomicUsize::new(0);
+    (0..rayon::current_num_threads())
+        .into_par_iter()
+        .for_each(|worker| loop {
+            let i = next_job.fetch_add(1, Ordering::SeqCst);
+            if i >= slots.len() {
+                break;
+            }
+            f(worker, &mut *slots[i].lock().unwrap());
+        });
+}
+
+// copy and free the buffer returned by the converter
+unsafe fn take_c_string(ptr: *mut libc::c_void, len: i32) -> String {
+    if ptr.is_null() {
+        return String::new();
+    }
+    let buf = slice::from_raw_parts(ptr as *const u8, len as usize).to_vec();
+    libc::free(ptr);
+    String::from_utf8(buf).unwrap()
+}
+
+fn seconds(start: Instant) -> f64 {
+    let elapsed = start.elapsed();
+    elapsed.as_secs() as f64 + elapsed.subsec_nanos() as f64 * 1e-9
+}
+
+// run one converter call under the memory budget,
+// returns the json, the box and the seconds it took
+fn convert_job<F>(budget: &MemBudget, info: &OsgbInfo, convert: F) -> (String, Vec<f64>, f64)
+where
+    F: FnOnce(*mut f64, *mut i32, *mut u64) -> *mut libc::c_void,
+{
+    let textures = texture_bytes(&info.max_path);
+    let estimate = budget.estimate(info.max_file, textures);
+    let admitted = budget.acquire(estimate);
+    // the wait for the budget is not the cost of the job
+    let start = Instant::now();
+    let mut peak_mem = 0u64;
+    let mut root_box = vec![0f64; 6];
+    let mut json_len = 0i32;
+    let out_ptr = convert(root_box.as_mut_ptr(), &mut json_len, &mut peak_mem);
+    budget.release(admitted, info.max_file, textures, peak_mem);
+    info!(
+        "{}: peak memory {} MB, estimated {} MB",
+        info.in_dir,
+        peak_mem >> 20,
+        estimate >> 20
+    );
+    if out_ptr.is_null() {
+        error!("failed: {}", info.in_dir);
+    }
+    let json = unsafe { take_c_string(out_ptr, json_len) };
+    (json, root_box, seconds(start))
+}
+
+pub fn osgb_batch_convert(
+    dir: &Path,
+    dir_dest: &Path,
+    center_x: f64,
+    center_y: f64,
+    config: &OsgbConfig,
+) -> Result<(), Box<dyn Error>> {
+    let path = dir.join("Data");
+    // .\Data directory
+    if !path.exists() || !path.is_dir() {
+        return Err(From::from(format!("dir {} not exist", path.display())));
+    }
+
+    fs::create_dir_all(dir_dest)?;
+    set_texture_options(config);
+    set_mesh_options(config);
+    // the conversions run in the workers, or on the rayon threads
+    set_task_threads(match config.pool {
+        Some(_) if !config.progressive => 1,
+        Some(ref pool) => pool.workers,
+        None => rayon::current_num_threads(),
+    });
+    let textures = TextureStats::default();
+    let textures_start = texture_cache_stats();
+    let meshes = MeshStats::default();
+    let meshes_start = mesh_stats();
+    let cost_model = CostModel::load(dir_dest);
+    let osgb_dir_pair = select_jobs(plan_jobs(&path, dir_dest, &cost_model)?, config);
+    info!("{} Tile_ to convert", osgb_dir_pair.len());
+    // only the Tile_ of this shard, the others are made by their machines
+    for info in &osgb_dir_pair {
+        fs::create_dir_all(&info.out_dir)?;
+    }
+    if !config.progressive {
+        config.add_total(osgb_dir_pair.len());
+    }
+    if config.progressive {
+        // the Tile_ trees stay open in this process between the levels,
+        // the worker count only sizes the threads
+        let ret = match config.pool {
+            Some(ref pool) => {
+                warn!(
+                    "progressive converts in this process, {} threads instead of worker processes",
+                    pool.workers
+                );
+                rayon::ThreadPoolBuilder::new()
+                    .num_threads(pool.workers)
+                    .build()?
+                    .install(|| progressive_convert(osgb_dir_pair, dir_dest, center_x, center_y, config))
+            }
+            None => progressive_convert(osgb_dir_pair, dir_dest, center_x, center_y, config),
+        };
+        textures.report(textures_start);
+        meshes.report(meshes_start);
+        return ret;
+    }
 
     let rad_x = unsafe { degree2rad(center_x) };
     let rad_y = unsafe { degree2rad(center_y) };
 
-    let max_lvl: i32 = max_lvl.unwrap_or(100);
-    osgb_dir_pair
-        .into_par_iter()
-        .map(|info| unsafe {
-            let mut root_box = vec![0f64; 6];
-            let mut json_buf = vec![];
-            let mut json_len = 0i32;
+    let max_lvl: i32 = config.max_lvl.unwrap_or(100);
+    let pbr_texture = config.pbr_texture;
+    let glb_content = config.glb_content;
+    let version = tileset_version(config);
+    let budget = MemBudget::new(config.mem_budget);
+    let results = Mutex::new(vec![]);
+    let timing = Mutex::new(vec![]);
+    let pool_size = config.pool.as_ref().map_or(0, |pool| pool.workers);
+    let workers: Vec<Mutex<Option<WorkerProcess>>> =
+        (0..pool_size).map(|_| Mutex::new(None)).collect();
+    let mut jobs: Vec<Option<OsgbInfo>> = osgb_dir_pair.into_iter().map(Some).collect();
+    let mut run_jobs = || dispatch_in_order(&mut jobs, |worker, job| {
+        let info = match job.take() {
+            Some(info) => info,
+            None => return,
+        };
+        let (json, root_box, sec) = if let Some(ref pool) = config.pool {
+            let job = json!({
+                "in_dir": info.in_dir,
+                "out_dir": info.out_dir,
+                "x": rad_x,
+                "y": rad_y,
+                "max_lvl": max_lvl,
+                "pbr": pbr_texture,
+                "glb": glb_content,
+                "texture_cache": config.texture_cache,
+                "texture_sse": config.texture_sse,
+                "texture_crop": config.texture_crop,
+                "texture_atlas": config.texture_atlas,
+                "texture_format": config.texture_format,
+                "texture_quality": config.texture_quality,
+                "texture_fallback": config.texture_fallback,
+                "normals": config.normals
+            });
+            pool_job(pool, &workers[worker], &budget, &textures, &meshes, &info, &job, dir, dir_dest)
+        } else {
             let in_ptr = str_to_vec_c(&info.in_dir);
             let out_ptr = str_to_vec_c(&info.out_dir);
-            let out_ptr = osgb23dtile_path(
+            convert_job(&budget, &info, |box_ptr, len, peak_mem| unsafe {
+                osgb23dtile_path(
+                    in_ptr.as_ptr(),
+                    out_ptr.as_ptr(),
+                    box_ptr,
+                    len,
+                    rad_x,
+                    rad_y,
+                    max_lvl,
+                    pbr_texture,
+                    glb_content,
+                    peak_mem,
+                )
+            })
+        };
+        // the Tile_ tileset is written (and compressed) here, from the json of the job
+        if !json.is_empty() {
+            if let Err(e) = write_sub_tileset(&info.out_dir, &json, version) {
+                error!("{}: {}", info.out_dir, e);
+            }
+        }
+        info!("{}: {:.1}s, estimated {:.1}s", info.in_dir, sec, info.cost);
+        config.add_done();
+        timing.lock().unwrap().push((info.name.clone(), info.size, sec));
+        if !json.is_empty() {
+            results.lock().unwrap().push(TileResult {
+                path: info.out_dir,
+                json: json,
+                box_v: root_box,
+            });
+        }
+    });
+    if pool_size > 0 {
+        // one thread feeds one worker process
+        rayon::ThreadPoolBuilder::new()
+            .num_threads(pool_size)
+            .build()?
+            .install(run_jobs);
+        for worker in workers {
+            if let Some(w) = worker.into_inner().unwrap() {
+                w.stop();
+            }
+        }
+    } else {
+        run_jobs();
+    }
+    textures.report(textures_start);
+    meshes.report(meshes_start);
+    if config.partial.is_none() {
+        // the shards would overwrite each other's model
+        if let Err(e) = CostModel::save(dir_dest, &timing.into_inner().unwrap()) {
+            error!("save cost model: {}", e);
+        }
+    }
+    let tile_array = results.into_inner().unwrap();
+    write_tiles(dir_dest, &tile_array.iter().collect::<Vec<_>>(), center_x, center_y, config)
+}
+
+/// size the texture cache and the texture budget of this process
+pub fn set_texture_options(config: &OsgbConfig) {
+    if let Some(bytes) = config.texture_cache {
+        unsafe { osgb_texture_cache(bytes) }
+    }
+    unsafe {
+        osgb_texture_options(
+            config.texture_sse.unwrap_or(0.0),
+            config.texture_crop,
+            config.texture_atlas,
+        )
+    }
+    let format = match config.texture_format.as_ref().map(|s| s.as_str()) {
+        None | Some("jpeg") => 0,
+        Some("webp") => 1,
+        Some("webp_lossless") => 2,
+        Some(other) => {
+            error!("unknown texture format {}, using jpeg", other);
+            0
+        }
+    };
+    unsafe {
+        osgb_texture_format(
+            format,
+            config.texture_quality.unwrap_or(80),
+            config.texture_fallback,
+        )
+    }
+}
+
+/// the NORMAL attribute of the tiles: none for the unlit materials, the
+/// osgb normals, or area weighted ones
+pub fn set_mesh_options(config: &OsgbConfig) {
+    let normals = match config.normals.as_ref().map(|s| s.as_str()) {
+        None | Some("auto") => 0,
+        Some("none") => 1,
+        Some("keep") => 2,
+        Some("generate") => 3,
+        Some(other) => {
+            error!("unknown normals {}, using auto", other);
+            0
+        }
+    };
+    unsafe { osgb_mesh_options(normals) }
+}
+
+/// the threads encoding the textures and making the normals of the tiles
+/// of this process, one per conversion thread
+pub fn set_task_threads(threads: usize) {
+    unsafe { osgb_task_threads(threads.max(1) as u32) }
+}
+
+/// texture cache hits and misses of this process since it started
+pub fn texture_cache_stats() -> (u64, u64) {
+    let mut hits = 0u64;
+    let mut misses = 0u64;
+    unsafe { osgb_texture_cache_stats(&mut hits, &mut misses) };
+    (hits, misses)
+}
+
+// the texture cache counters of a run, the workers send theirs with the results
+#[derive(Default)]
+struct TextureStats {
+    hits: AtomicUsize,
+    misses: AtomicUsize,
+}
+
+impl TextureStats {
+    fn add(&self, hits: u64, misses: u64) {
+        self.hits.fetch_add(hits as usize, Ordering::SeqCst);
+        self.misses.fetch_add(misses as usize, Ordering::SeqCst);
+    }
+
+    // add this process' counters since `start` and log the run total
+    fn report(&self, start: (u64, u64)) {
+        let (hits, misses) = texture_cache_stats();
+        self.add(hits - start.0, misses - start.1);
+        info!(
+            "texture cache: {} hits, {} misses",
+            self.hits.load(Ordering::SeqCst),
+            self.misses.load(Ordering::SeqCst)
+        );
+    }
+}
+
+/// vertex and index bytes of the geometries of this process before and
+/// after the degenerate triangles and duplicate vertices were removed
+pub fn mesh_stats() -> (u64, u64) {
+    let mut bytes_in = 0u64;
+    let mut bytes_out = 0u64;
+    unsafe { osgb_mesh_stats(&mut bytes_in, &mut bytes_out) };
+    (bytes_in, bytes_out)
+}
+
+// the mesh cleanup counters of a run, the workers send theirs with the results
+#[derive(Default)]
+struct MeshStats {
+    bytes_in: AtomicUsize,
+    bytes_out: AtomicUsize,
+}
+
+impl MeshStats {
+    fn add(&self, bytes_in: u64, bytes_out: u64) {
+        self.bytes_in.fetch_add(bytes_in as usize, Ordering::SeqCst);
+        self.bytes_out.fetch_add(bytes_out as usize, Ordering::SeqCst);
+    }
+
+    // add this process' counters since `start` and log the run total
+    fn report(&self, start: (u64, u64)) {
+        let (bytes_in, bytes_out) = mesh_stats();
+        self.add(bytes_in - start.0, bytes_out - start.1);
+        let bytes_in = self.bytes_in.load(Ordering::SeqCst);
+        let bytes_out = self.bytes_out.load(Ordering::SeqCst);
+        info!(
+            "mesh cleanup: {} of {} MB vertex and index bytes saved",
+            (bytes_in - bytes_out) >> 20,
+            bytes_in >> 20
+        );
+    }
+}
+
+// the results of the worker, its stdout moved away from fd 1: the plugins
+// printing on stdout write to stderr, the pipe only carries the results
+struct ResultPipe {
+    fd: libc::c_int,
+}
+
+impl ResultPipe {
+    fn take_stdout() -> io::Result<ResultPipe> {
+        let fd = unsafe { libc::dup(1) };
+        if fd < 0 || unsafe { libc::dup2(2, 1) } < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(ResultPipe { fd: fd })
+    }
+}
+
+impl Write for ResultPipe {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        let n = unsafe { libc::write(self.fd, buf.as_ptr() as *const libc::c_void, buf.len() as _) };
+        if n < 0 {
+            Err(io::Error::last_os_error())
+        } else {
+            Ok(n as usize)
+        }
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
+// the Tile_ which crashed their workers too often
+const QUARANTINE_FILE: &str = "quarantine.txt";
+
+struct WorkerProcess {
+    child: Child,
+    stdin: ChildStdin,
+    stdout: BufReader<ChildStdout>,
+    jobs: usize,
+}
+
+impl WorkerProcess {
+    fn spawn(pool: &PoolConfig, dir: &Path, dir_dest: &Path) -> io::Result<WorkerProcess> {
+        let mut child = Command::new(env::current_exe()?)
+            .arg("-f")
+            .arg("osgb-worker")
+            .arg("-i")
+            .arg(dir)
+            .arg("-o")
+            .arg(dir_dest)
+            .args(&pool.args)
+            .stdin(Stdio::piped())
+            .stdout(Stdio::piped())
+            .spawn()?;
+        let stdin = child.stdin.take().unwrap();
+        let stdout = BufReader::new(child.stdout.take().unwrap());
+        Ok(WorkerProcess {
+            child: child,
+            stdin: stdin,
+            stdout: stdout,
+            jobs: 0,
+        })
+    }
+
+    // None if the worker died on the job
+    fn run(&mut self, job: &serde_json::Value) -> Option<serde_json::Value> {
+        writeln!(self.stdin, "{}", job).ok()?;
+        self.stdin.flush().ok()?;
+        let mut line = String::new();
+        if self.stdout.read_line(&mut line).ok()? == 0 {
+            return None;
+        }
+        self.jobs += 1;
+        serde_json::from_str(&line).ok()
+    }
+
+    // the worker exits at the end of its stdin
+    fn stop(self) {
+        let WorkerProcess { mut child, stdin, .. } = self;
+        drop(stdin);
+        let _ = child.wait();
+    }
+
+    fn kill(mut self) {
+        let _ = self.child.kill();
+        let _ = self.child.wait();
+    }
+}
+
+// run a job in the worker process of this thread,
+// a crashed worker is replaced and the job retried, then quarantined
+fn pool_job(
+    pool: &PoolConfig,
+    slot: &Mutex<Option<WorkerProcess>>,
+    budget: &MemBudget,
+    texture_stats: &TextureStats,
+    meshes: &MeshStats,
+    info: &OsgbInfo,
+    job: &serde_json::Value,
+    dir: &Path,
+    dir_dest: &Path,
+) -> (String, Vec<f64>, f64) {
+    let mut slot = slot.lock().unwrap();
+    let textures = texture_bytes(&info.max_path);
+    let estimate = budget.estimate(info.max_file, textures);
+    let admitted = budget.acquire(estimate);
+    let start = Instant::now();
+    let mut reply = None;
+    for attempt in 0..pool.retries + 1 {
+        if slot.is_none() {
+            match WorkerProcess::spawn(pool, dir, dir_dest) {
+                Ok(w) => *slot = Some(w),
+                Err(e) => {
+                    error!("start worker: {}", e);
+                    break;
+                }
+            }
+        }
+        reply = slot.as_mut().unwrap().run(job);
+        if reply.is_some() {
+            break;
+        }
+        error!("{}: worker crashed, attempt {}", info.in_dir, attempt + 1);
+        slot.take().unwrap().kill();
+    }
+    let reply = match reply {
+        Some(v) => v,
+        None => {
+            budget.release(admitted, info.max_file, textures, 0);
+            error!("{}: quarantined", info.in_dir);
+            let quarantine = OpenOptions::new()
+                .create(true)
+                .append(true)
+                .open(dir_dest.join(QUARANTINE_FILE))
+                .and_then(|mut f| writeln!(f, "{}", info.in_dir));
+            if let Err(e) = quarantine {
+                error!("{}: {}", QUARANTINE_FILE, e);
+            }
+            return (String::new(), vec![0f64; 6], seconds(start));
+        }
+    };
+    let peak_mem = reply["peak_mem"].as_u64().unwrap_or(0);
+    budget.release(admitted, info.max_file, textures, peak_mem);
+    texture_stats.add(
+        reply["texture_hits"].as_u64().unwrap_or(0),
+        reply["texture_misses"].as_u64().unwrap_or(0),
+    );
+    meshes.add(
+        reply["mesh_in"].as_u64().unwrap_or(0),
+        reply["mesh_out"].as_u64().unwrap_or(0),
+    );
+    info!(
+        "{}: peak memory {} MB, estimated {} MB",
+        info.in_dir,
+        peak_mem >> 20,
+        estimate >> 20
+    );
+    // recycle the worker, the leaks of the plugins stay with it
+    let rss = reply["rss"].as_u64().unwrap_or(0);
+    let recycle = pool.max_jobs > 0 && slot.as_ref().unwrap().jobs >= pool.max_jobs
+        || pool.max_rss.map_or(false, |max| rss > max);
+    if recycle {
+        slot.take().unwrap().stop();
+    }
+    let json = reply["json"].as_str().unwrap_or("").to_string();
+    if json.is_empty() {
+        error!("failed: {}", info.in_dir);
+    }
+    let root_box = reply["box"]
+        .as_array()
+        .map(|v| v.iter().map(|x| x.as_f64().unwrap_or(0.0)).collect())
+        .unwrap_or(vec![0f64; 6]);
+    (json, root_box, seconds(start))
+}
+
+#[cfg(target_os = "linux")]
+fn current_rss() -> u64 {
+    // statm: size resident shared ... in pages
+    let statm = fs::read_to_string("/proc/self/statm").unwrap_or_default();
+    let pages: u64 = statm
+        .split_whitespace()
+        .nth(1)
+        .and_then(|v| v.parse().ok())
+        .unwrap_or(0);
+    pages * unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as u64
+}
+
+#[cfg(not(target_os = "linux"))]
+fn current_rss() -> u64 {
+    0
+}
+
+/// the worker process of the pool, a json job per line on stdin
+/// and a result line on the stdout pipe, until stdin is closed
+pub fn osgb_worker() {
+    // one job at a time, the other workers have the other cores
+    set_task_threads(1);
+    let mut results = match ResultPipe::take_stdout() {
+        Ok(pipe) => pipe,
+        Err(e) => {
+            error!("worker stdout: {}", e);
+            return;
+        }
+    };
+    let stdin = io::stdin();
+    for line in stdin.lock().lines() {
+        let line = match line {
+            Ok(line) => line,
+            Err(_) => break,
+        };
+        let job: serde_json::Value = match serde_json::from_str(&line) {
+            Ok(v) => v,
+            Err(e) => {
+                error!("bad job {}: {}", line, e);
+                continue;
+            }
+        };
+        let in_ptr = str_to_vec_c(job["in_dir"].as_str().unwrap_or(""));
+        let out_ptr = str_to_vec_c(job["out_dir"].as_str().unwrap_or(""));
+        let mut root_box = vec![0f64; 6];
+        let mut json_len = 0i32;
+        let mut peak_mem = 0u64;
+        let job_config = OsgbConfig {
+            texture_cache: job["texture_cache"].as_u64(),
+            texture_sse: job["texture_sse"].as_f64(),
+            texture_crop: job["texture_crop"].as_bool().unwrap_or(false),
+            texture_atlas: job["texture_atlas"].as_bool().unwrap_or(false),
+            texture_format: job["texture_format"].as_str().map(|s| s.to_string()),
+            texture_quality: job["texture_quality"].as_i64().map(|q| q as i32),
+            texture_fallback: job["texture_fallback"].as_bool().unwrap_or(false),
+            normals: job["normals"].as_str().map(|s| s.to_string()),
+            ..Default::default()
+        };
+        set_texture_options(&job_config);
+        set_mesh_options(&job_config);
+        let (hits, misses) = texture_cache_stats();
+        let (mesh_in, mesh_out) = mesh_stats();
+        let json = unsafe {
+            let ptr = osgb23dtile_path(
                 in_ptr.as_ptr(),
                 out_ptr.as_ptr(),
                 root_box.as_mut_ptr(),
-                (&mut json_len) as *mut i32,
-                rad_x,
-                rad_y,
-                max_lvl,
-                pbr_texture,
+                &mut json_len,
+                job["x"].as_f64().unwrap_or(0.0),
+                job["y"].as_f64().unwrap_or(0.0),
+                job["max_lvl"].as_i64().unwrap_or(100) as i32,
+                job["pbr"].as_bool().unwrap_or(false),
+                job["glb"].as_bool().unwrap_or(false),
+                &mut peak_mem,
             );
-            if out_ptr.is_null() {
-                error!("failed: {}", info.in_dir);
-            } else {
-                json_buf.resize(json_len as usize, 0);
-                libc::memcpy(
-                    json_buf.as_mut_ptr() as *mut libc::c_void,
-                    out_ptr,
-                    json_len as usize,
-                );
-                libc::free(out_ptr);
+            take_c_string(ptr, json_len)
+        };
+        let textures = texture_cache_stats();
+        let meshes = mesh_stats();
+        let reply = json!({
+            "json": json,
+            "box": root_box,
+            "peak_mem": peak_mem,
+            "rss": current_rss(),
+            "texture_hits": textures.0 - hits,
+            "texture_misses": textures.1 - misses,
+            "mesh_in": meshes.0 - mesh_in,
+            "mesh_out": meshes.1 - mesh_out
+        });
+        if writeln!(results, "{}", reply).is_err() {
+            break;
+        }
+    }
+}
+
+// a Tile_ tree kept open between the levels of the progressive mode
+struct OpenTile {
+    info: OsgbInfo,
+    tree: *mut libc::c_void,
+    result: Option<TileResult>,
+    seconds: f64,
+}
+
+// the tree is only used by the worker holding the job
+unsafe impl Send for OpenTile {}
+
+// convert level by level over all the Tile_, coarse to fine,
+// the tilesets are replaced after every level so the data is viewable early
+fn progressive_convert(
+    osgb_dir_pair: Vec<OsgbInfo>,
+    dir_dest: &Path,
+    center_x: f64,
+    center_y: f64,
+    config: &OsgbConfig,
+) -> Result<(), Box<dyn Error>> {
+    let rad_x = unsafe { degree2rad(center_x) };
+    let rad_y = unsafe { degree2rad(center_y) };
+
+    let max_lvl: i32 = config.max_lvl.unwrap_or(100);
+    let pbr_texture = config.pbr_texture;
+    let glb_content = config.glb_content;
+    let version = tileset_version(config);
+    let budget = MemBudget::new(config.mem_budget);
+    let mut tiles: Vec<OpenTile> = osgb_dir_pair
+        .into_iter()
+        .map(|info| OpenTile {
+            info: info,
+            tree: ptr::null_mut(),
+            result: None,
+            seconds: 0.0,
+        })
+        .collect();
+    dispatch_in_order(&mut tiles, |_, tile| unsafe {
+        let in_ptr = str_to_vec_c(&tile.info.in_dir);
+        tile.tree = osgb23dtile_open(in_ptr.as_ptr());
+    });
+    tiles.retain(|tile| !tile.tree.is_null());
+
+    // the root osgb has no _L, it is level -1
+    let mut lvl = -2;
+    loop {
+        lvl = tiles
+            .iter()
+            .map(|tile| unsafe { osgb23dtile_next_level(tile.tree, lvl) })
+            .min()
+            .unwrap_or(i32::max_value());
+        if lvl == i32::max_value() || lvl > max_lvl {
+            break;
+        }
+        config.add_total(tiles.len());
+        dispatch_in_order(&mut tiles, |_, tile| {
+            let tree = tile.tree;
+            let in_ptr = str_to_vec_c(&tile.info.in_dir);
+            let out_ptr = str_to_vec_c(&tile.info.out_dir);
+            let (json, root_box, sec) =
+                convert_job(&budget, &tile.info, |box_ptr, len, peak_mem| unsafe {
+                    osgb23dtile_level(
+                        tree,
+                        in_ptr.as_ptr(),
+                        out_ptr.as_ptr(),
+                        box_ptr,
+                        len,
+                        rad_x,
+                        rad_y,
+                        lvl,
+                        pbr_texture,
+                        glb_content,
+                        peak_mem,
+                    )
+                });
+            tile.seconds += sec;
+            config.add_done();
+            if json.is_empty() {
+                return;
+            }
+            if let Err(e) = write_sub_tileset(&tile.info.out_dir, &json, version) {
+                error!("{}: {}", tile.info.out_dir, e);
             }
-            let t = TileResult {
-                path: info.out_dir.into(),
-                json: String::from_utf8(json_buf).unwrap(),
+            tile.result = Some(TileResult {
+                path: tile.info.out_dir.clone(),
+                json: json,
                 box_v: root_box,
-            };
-            info.sender.send(t).unwrap();
+            });
+        });
+        let tile_array: Vec<&TileResult> = tiles.iter().filter_map(|t| t.result.as_ref()).collect();
+        write_tiles(dir_dest, &tile_array, center_x, center_y, config)?;
+        info!("level {} done, {} tiles", lvl, tile_array.len());
+    }
+
+    let timing: Vec<_> = tiles
+        .iter()
+        .map(|t| (t.info.name.clone(), t.info.size, t.seconds))
+        .collect();
+    for tile in tiles {
+        unsafe { osgb23dtile_close(tile.tree) };
+    }
+    if config.partial.is_none() {
+        if let Err(e) = CostModel::save(dir_dest, &timing) {
+            error!("save cost model: {}", e);
+        }
+    }
+    Ok(())
+}
+
+// glb content needs 3D Tiles 1.1
+fn tileset_version(config: &OsgbConfig) -> &'static str {
+    if config.glb_content {
+        "1.1"
+    } else {
+        "1.0"
+    }
+}
+
+// the b3dm of 1.0 are z-up, 1.1 has no gltfUpAxis and its glb are turned y-up
+fn tileset_asset(version: &str) -> serde_json::Value {
+    if version == "1.0" {
+        json!({ "version": version, "gltfUpAxis": "Z" })
+    } else {
+        json!({ "version": version })
+    }
+}
+
+// the partial results of the shards, merged by osgb_merge
+const PARTIAL_DIR: &str = "partial";
+
+// the root tileset, or the partial result of a shard
+fn write_tiles(
+    dir_dest: &Path,
+    tile_array: &[&TileResult],
+    center_x: f64,
+    center_y: f64,
+    config: &OsgbConfig,
+) -> Result<(), Box<dyn Error>> {
+    let name = match config.partial {
+        Some(ref name) => name,
+        None => return write_root_tileset(dir_dest, tile_array, center_x, center_y, config),
+    };
+    // relative paths, the shards may mount the output somewhere else
+    let out_dir: String = dir_dest.to_string_lossy().into();
+    let tiles: Vec<serde_json::Value> = tile_array
+        .iter()
+        .map(|t| {
+            json!({
+                "path": t.path.replace(&out_dir, ".").replace("\\", "/"),
+                "json": t.json,
+                "box": t.box_v
+            })
         })
-        .count();
-
-    // merge and root
-    let mut tile_array = vec![];
-    for _ in 0..task_count {
-        if let Ok(t) = receiver.recv() {
-            if !t.json.is_empty() {
-                tile_array.push(t);
+        .collect();
+    let partial_dir = dir_dest.join(PARTIAL_DIR);
+    fs::create_dir_all(&partial_dir)?;
+    let path = partial_dir.join(name).with_extension("json");
+    replace_output(&path, &serde_json::to_vec(&json!({ "tiles": tiles }))?)?;
+    Ok(())
+}
+
+/// make the root tileset from the partial results of all the shards
+pub fn osgb_merge(
+    dir_dest: &Path,
+    center_x: f64,
+    center_y: f64,
+    config: &OsgbConfig,
+) -> Result<(), Box<dyn Error>> {
+    let mut files: Vec<_> = fs::read_dir(dir_dest.join(PARTIAL_DIR))?
+        .filter_map(|e| e.ok())
+        .map(|e| e.path())
+        .filter(|p| p.extension().map_or(false, |e| e == "json"))
+        .collect();
+    files.sort();
+    let out_dir: String = dir_dest.to_string_lossy().into();
+    let mut tiles: Vec<TileResult> = vec![];
+    let mut seen = HashSet::new();
+    for file in &files {
+        let val: serde_json::Value = serde_json::from_slice(&fs::read(file)?)?;
+        let list = match val["tiles"].as_array() {
+            Some(list) => list,
+            None => {
+                error!("{}: no tiles", file.display());
+                continue;
+            }
+        };
+        for t in list {
+            let path = t["path"].as_str().unwrap_or("");
+            // a Tile_ converted again by another shard
+            if !seen.insert(path.to_string()) {
+                continue;
             }
+            tiles.push(TileResult {
+                path: path.replacen(".", &out_dir, 1),
+                json: t["json"].as_str().unwrap_or("").into(),
+                box_v: t["box"]
+                    .as_array()
+                    .map(|v| v.iter().map(|x| x.as_f64().unwrap_or(0.0)).collect())
+                    .unwrap_or(vec![0f64; 6]),
+            });
         }
     }
+    tiles.sort_by(|a, b| a.path.cmp(&b.path));
+    info!("merge {} Tile_ from {} partial results", tiles.len(), files.len());
+    let tile_array: Vec<&TileResult> = tiles.iter().collect();
+    write_root_tileset(dir_dest, &tile_array, center_x, center_y, config)
+}
+
+fn write_root_tileset(
+    dir_dest: &Path,
+    tile_array: &[&TileResult],
+    center_x: f64,
+    center_y: f64,
+    config: &OsgbConfig,
+) -> Result<(), Box<dyn Error>> {
     let mut root_box = vec![-1.0E+38f64, -1.0E+38, -1.0E+38, 1.0E+38, 1.0E+38, 1.0E+38];
     for x in tile_array.iter() {
         for i in 0..3 {
@@ -174,7 +1315,7 @@ pub fn osgb_batch_convert(
     //let root_geometric_error = get_geometric_error(center_y, 10);
     // do merge plz
     let mut tras_height = 0f64;
-    if let Some(v) = region_offset {
+    if let Some(v) = config.region_offset {
         tras_height = v - root_box[5];
     }
     let mut trans_vec = vec![0f64; 16];
@@ -183,10 +1324,7 @@ pub fn osgb_batch_convert(
     }
     let mut root_json = json!(
         {
-            "asset": {
-                "version": "1.0",
-                "gltfUpAxis": "Z"
-            },
+            "asset": tileset_asset(tileset_version(config)),
             "geometricError": 2000,
             "root" : {
                 "transform" : trans_vec,
@@ -201,7 +1339,7 @@ pub fn osgb_batch_convert(
 
     let out_dir: String = dir_dest.to_string_lossy().into();
     for x in tile_array {
-        let path = x.path;
+        let path = &x.path;
         let json_val: serde_json::Value = serde_json::from_str(&x.json).unwrap();
         let tile_box = json_val["boundingVolume"]["box"].as_array().unwrap();
         let tile_object = json!(
@@ -219,22 +1357,22 @@ pub fn osgb_batch_convert(
             .as_array_mut()
             .unwrap()
             .push(tile_object);
-        let sub_tile = json!({
-            "asset": {
-                "version": "1.0",
-                "gltfUpAxis":"Z"
-            },
-            "geometricError": 1000,
-            "root": json_val
-        }
-        );
-        let out_file = path.clone() + "/tileset.json";
-        let mut f = File::create(out_file)?;
-        f.write_all(serde_json::to_string_pretty(&sub_tile).unwrap().as_bytes())?;
     }
     let path_json = dir_dest.join("tileset.json");
-    let mut f = File::create(path_json)?;
-    f.write_all(serde_json::to_string_pretty(&root_json).unwrap().as_bytes())?;
+    replace_output(&path_json, &serde_json::to_vec(&root_json)?)?;
+    Ok(())
+}
+
+fn write_sub_tileset(out_dir: &str, json: &str, version: &str) -> Result<(), Box<dyn Error>> {
+    let json_val: serde_json::Value = serde_json::from_str(json)?;
+    let sub_tile = json!({
+        "asset": tileset_asset(version),
+        "geometricError": 1000,
+        "root": json_val
+    }
+    );
+    let out_file = Path::new(out_dir).join("tileset.json");
+    replace_output(&out_file, &serde_json::to_vec(&sub_tile)?)?;
     Ok(())
 }
 
@@ -1,15 +1,26 @@
 #include <osg/Material>
 #include <osg/PagedLOD>
+#include <osg/TriangleIndexFunctor>
 #include <osgDB/ReadFile>
 #include <osgDB/ConvertUTF>
 #include <osgUtil/Optimizer>
-#include <osgUtil/SmoothingVisitor>
 
 #include <set>
+#include <list>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <condition_variable>
 #include <cmath>
 #include <vector>
 #include <string>
 #include <cstring>
+#include <climits>
 #include <algorithm>
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -18,6 +29,7 @@
 #include "tiny_gltf.h"
 #include "stb_image_write.h"
 #include "dxt_img.h"
+#include "img_encoder.h"
 #include "extern.h"
 
 using namespace std;
@@ -30,6 +42,38 @@ using namespace std;
 #endif // max
 
 static bool b_pbr_texture = false;
+// write .glb tile content instead of .b3dm
+static bool b_glb_content = false;
+// estimated peak memory of the osgb23dtile_path running on this thread
+static thread_local size_t tile_peak_mem = 0;
+// the screen-space error (pixels) the client refines at, 0 keeps the texture size
+static double texture_sse = 0;
+// crop the textures to the uv bounds of the tile
+static bool b_texture_crop = false;
+// pack the textures of a tile in atlases
+static bool b_texture_atlas = false;
+// the pixels kept around the uv bounds for the texture filtering
+static const int crop_padding = 4;
+
+static int texture_format = TEX_JPEG;
+static int texture_quality = 80;
+// a jpeg next to the webp image, for the clients without EXT_texture_webp
+static bool b_texture_fallback = false;
+
+enum NormalMode
+{
+    // none for the unlit materials, generated with pbr
+    NORMAL_AUTO = 0,
+    NORMAL_NONE = 1,
+    // the per vertex normals of the osgb, if any
+    NORMAL_KEEP = 2,
+    // area weighted vertex normals
+    NORMAL_GENERATE = 3
+};
+static int normal_mode = NORMAL_AUTO;
+// the vertex and index bytes of the geometries before and after clean_geometry
+static std::atomic<unsigned long long> mesh_bytes_in(0);
+static std::atomic<unsigned long long> mesh_bytes_out(0);
 
 template<class T>
 void put_val(std::vector<unsigned char>& buf, T val) {
@@ -41,9 +85,245 @@ void put_val(std::string& buf, T val) {
     buf.append((unsigned char*)&val, (unsigned char*)&val + sizeof(T));
 }
 
-void write_buf(void* context, void* data, int len) {
-    std::vector<char> *buf = (std::vector<char>*)context;
-    buf->insert(buf->end(), (char*)data, (char*)data + len);
+typedef std::shared_ptr<const std::vector<unsigned char>> ImageBuf;
+
+// the pixels [x0, x1) x [y0, y1) of a texture used by a tile
+struct TexCrop
+{
+    int x0, y0, x1, y1;
+};
+
+/**
+ * encoded textures by the hash of their pixels, smart3d repeats the same
+ * texture in several LOD files, it is encoded once per run
+*/
+struct TextureCache
+{
+    std::mutex mtx;
+    // most recently used first
+    std::list<uint64_t> order;
+    std::unordered_map<uint64_t, std::pair<ImageBuf, std::list<uint64_t>::iterator>> items;
+    size_t capacity = 256 << 20;
+    size_t used = 0;
+    unsigned long long hits = 0;
+    unsigned long long misses = 0;
+
+    ImageBuf get(uint64_t key) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = items.find(key);
+        if (it == items.end()) {
+            misses++;
+            return ImageBuf();
+        }
+        hits++;
+        order.splice(order.begin(), order, it->second.second);
+        return it->second.first;
+    }
+
+    void put(uint64_t key, ImageBuf buf) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (buf->size() > capacity || items.count(key)) {
+            return;
+        }
+        order.push_front(key);
+        items[key] = std::make_pair(buf, order.begin());
+        used += buf->size();
+        while (used > capacity) {
+            auto last = items.find(order.back());
+            used -= last->second.first->size();
+            items.erase(last);
+            order.pop_back();
+        }
+    }
+};
+
+static TextureCache texture_cache;
+
+/**
+ * the threads shared by the tiles, for the texture encodes and the
+ * normals of the geometries. a task nobody has
+ * started when its result is needed runs on the waiting thread, so the
+ * tile threads never sit idle behind a busy pool
+*/
+class TaskPool
+{
+public:
+    struct Task
+    {
+        std::function<void()> run;
+        std::atomic<bool> claimed;
+        std::mutex mtx;
+        std::condition_variable cond;
+        bool done;
+
+        Task() : claimed(false), done(false) {}
+    };
+    typedef std::shared_ptr<Task> TaskPtr;
+
+    TaskPool(unsigned threads) {
+        for (unsigned i = 0; i < threads; i++) {
+            // the pool lives as long as the process
+            std::thread(&TaskPool::work, this).detach();
+        }
+    }
+
+    TaskPtr submit(std::function<void()> run) {
+        TaskPtr task = std::make_shared<Task>();
+        task->run = run;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            queue.push_back(task);
+        }
+        cond.notify_one();
+        return task;
+    }
+
+    void wait(const TaskPtr& task) {
+        if (!execute(task)) {
+            std::unique_lock<std::mutex> lock(task->mtx);
+            while (!task->done) {
+                task->cond.wait(lock);
+            }
+        }
+    }
+
+private:
+    std::mutex mtx;
+    std::condition_variable cond;
+    std::deque<TaskPtr> queue;
+
+    // false if another thread has the task
+    bool execute(const TaskPtr& task) {
+        if (task->claimed.exchange(true)) {
+            return false;
+        }
+        task->run();
+        std::lock_guard<std::mutex> lock(task->mtx);
+        task->done = true;
+        task->cond.notify_all();
+        return true;
+    }
+
+    void work() {
+        while (true) {
+            TaskPtr task;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                while (queue.empty()) {
+                    cond.wait(lock);
+                }
+                task = queue.front();
+                queue.pop_front();
+            }
+            execute(task);
+        }
+    }
+};
+
+// the threads of the task pool, 0 for one per core
+static unsigned task_threads = 0;
+
+TaskPool& task_pool() {
+    static TaskPool* pool = new TaskPool(
+        task_threads ? task_threads : std::max(1u, std::thread::hardware_concurrency()));
+    return *pool;
+}
+
+/**
+ * the threads of the task pool, set before the first tile: the pool is
+ * made by the first tile and lives as long as the process
+*/
+extern "C" void
+osgb_task_threads(unsigned threads)
+{
+    task_threads = threads;
+}
+
+// FNV-1a step over n bytes
+uint64_t image_hash_mix(uint64_t h, const void* data, size_t n) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// FNV-1a of the pixels, the layout of the image, its crop and size limit
+uint64_t image_hash(osg::Image* img, const TexCrop& crop, int max_size) {
+    int layout[9] = {
+        img->s(), img->t(), (int)img->getPixelFormat(), (int)img->getDataType(),
+        crop.x0, crop.y0, crop.x1, crop.y1, max_size
+    };
+    uint64_t h = image_hash_mix(14695981039346656037ULL, layout, sizeof(layout));
+    return image_hash_mix(h, img->data(), img->getTotalSizeInBytes());
+}
+
+/**
+ * the texture cache size in bytes, 0 disables it
+*/
+extern "C" void
+osgb_texture_cache(unsigned long long capacity)
+{
+    std::lock_guard<std::mutex> lock(texture_cache.mtx);
+    texture_cache.capacity = capacity;
+}
+
+/**
+ * sse is the maximumScreenSpaceError of the client, the textures of a tile
+ * are limited to the pixels it covers before it is refined, 0 disables it.
+ * crop keeps only the part of the textures the uvs of the tile use,
+ * atlas packs the textures of a tile in one or a few images
+*/
+extern "C" void
+osgb_texture_options(double sse, bool crop, bool atlas)
+{
+    texture_sse = sse;
+    b_texture_crop = crop;
+    b_texture_atlas = atlas;
+}
+
+/**
+ * the image format of the textures, webp needs the ENABLE_WEBP build,
+ * quality is 0 to 100, fallback adds a jpeg to the webp textures
+*/
+extern "C" void
+osgb_texture_format(int format, int quality, bool fallback)
+{
+    if (!image_encoder(format)) {
+        LOG_E("built without webp, the textures stay jpeg");
+        format = TEX_JPEG;
+    }
+    texture_format = format;
+    texture_quality = std::min(100, std::max(1, quality));
+    b_texture_fallback = fallback && format != TEX_JPEG;
+}
+
+/**
+ * the NORMAL attribute of the osgb tiles, a NormalMode
+*/
+extern "C" void
+osgb_mesh_options(int normals)
+{
+    if (normals < NORMAL_AUTO || normals > NORMAL_GENERATE) {
+        LOG_E("unknown normal mode %d", normals);
+        normals = NORMAL_AUTO;
+    }
+    normal_mode = normals;
+}
+
+extern "C" void
+osgb_mesh_stats(unsigned long long* bytes_in, unsigned long long* bytes_out)
+{
+    *bytes_in = mesh_bytes_in;
+    *bytes_out = mesh_bytes_out;
+}
+
+extern "C" void
+osgb_texture_cache_stats(unsigned long long* hits, unsigned long long* misses)
+{
+    std::lock_guard<std::mutex> lock(texture_cache.mtx);
+    *hits = texture_cache.hits;
+    *misses = texture_cache.misses;
 }
 
 struct TileBox
@@ -99,10 +379,16 @@ public:
     void apply(osg::PagedLOD& node) {
         //std::string path = node.getDatabasePath();
         int n = node.getNumFileNames();
+        // smart3d sets the center and radius of the children
+        osg::BoundingSphere bound(node.getCenter(), node.getRadius());
+        if (node.getRadius() < 0) {
+            bound = node.getBound();
+        }
         for (size_t i = 1; i < n; i++)
         {
             std::string file_name = path + "/" + node.getFileName(i);
             sub_node_names.push_back(file_name);
+            sub_node_bounds.push_back(bound);
         }
         traverse(node);
     }
@@ -112,6 +398,7 @@ public:
     std::set<osg::Texture*> texture_array;
     std::map<osg::Geometry*, osg::Texture*> texture_map;
     std::vector<std::string> sub_node_names;
+    std::vector<osg::BoundingSphere> sub_node_bounds;
 };
 
 double get_geometric_error(TileBox& bbox){
@@ -422,8 +709,11 @@ struct OsgBuildState
     tinygltf::Model* model;
     osg::Vec3f point_max;
     osg::Vec3f point_min;
-    int draw_array_first;
-    int draw_array_count;
+    // TEXCOORD_0 = uv * uv_scale + uv_offset, for the cropped textures
+    osg::Vec2f uv_scale;
+    osg::Vec2f uv_offset;
+    // write the per vertex normals
+    bool normals;
 };
 
 void expand_bbox3d(osg::Vec3f& point_max, osg::Vec3f& point_min, osg::Vec3f point)
@@ -454,11 +744,23 @@ write_osg_indecis(T* drawElements, OsgBuildState* osgState, int componentType)
     unsigned IndNum = drawElements->getNumIndices();
     for (unsigned m = 0; m < IndNum; m++)
     {
-        auto idx = drawElements->at(m);
-        put_val(osgState->buffer->data, idx);
+        unsigned idx = drawElements->at(m);
         if (idx > max_index) max_index = idx;
         if (idx < min_index) min_index = idx;
     }
+    // uint16 when the vertices fit, 0xffff is the primitive restart index
+    if (componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT && max_index < 0xffff)
+    {
+        componentType = TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT;
+    }
+    for (unsigned m = 0; m < IndNum; m++)
+    {
+        auto idx = drawElements->at(m);
+        if (componentType == TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT)
+            put_val(osgState->buffer->data, (unsigned short)idx);
+        else
+            put_val(osgState->buffer->data, idx);
+    }
     alignment_buffer(osgState->buffer->data);
 
     tinygltf::Accessor acc;
@@ -483,11 +785,6 @@ write_vec3_array(osg::Vec3Array* v3f, OsgBuildState* osgState, osg::Vec3f& point
 {
     int vec_start = 0;
     int vec_end   = v3f->size();
-    if (osgState->draw_array_first >= 0)
-    {
-        vec_start = osgState->draw_array_first;
-        vec_end   = osgState->draw_array_count + vec_start;
-    }
     unsigned buffer_start = osgState->buffer->data.size();
     for (int vidx = vec_start; vidx < vec_end; vidx++)
     {
@@ -521,17 +818,14 @@ write_vec2_array(osg::Vec2Array* v2f, OsgBuildState* osgState)
 {
     int vec_start = 0;
     int vec_end   = v2f->size();
-    if (osgState->draw_array_first >= 0)
-    {
-        vec_start = osgState->draw_array_first;
-        vec_end   = osgState->draw_array_count + vec_start;
-    }
     osg::Vec2f point_max(-1e38, -1e38);
     osg::Vec2f point_min(1e38, 1e38);
     unsigned buffer_start = osgState->buffer->data.size();
     for (int vidx = vec_start; vidx < vec_end; vidx++)
     {
         osg::Vec2f point = v2f->at(vidx);
+        point.x() = point.x() * osgState->uv_scale.x() + osgState->uv_offset.x();
+        point.y() = point.y() * osgState->uv_scale.y() + osgState->uv_offset.y();
         put_val(osgState->buffer->data, point.x());
         put_val(osgState->buffer->data, point.y());
         expand_bbox2d(point_max, point_min, point);
@@ -568,8 +862,6 @@ write_element_array_primitive(osg::Geometry* g, osg::PrimitiveSet* ps, OsgBuildS
     tinygltf::Primitive primits;
     // indecis
     primits.indices = osgState->model->accessors.size();
-    // reset draw_array state
-    osgState->draw_array_first = -1;
     osg::PrimitiveSet::Type t = ps->getType();
     switch (t)
     {
@@ -591,14 +883,6 @@ write_element_array_primitive(osg::Geometry* g, osg::PrimitiveSet* ps, OsgBuildS
             write_osg_indecis(drawElements, osgState, TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT);
             break;
         }
-        case osg::PrimitiveSet::DrawArraysPrimitiveType:
-        {
-            primits.indices = -1;
-            osg::DrawArrays* da = dynamic_cast<osg::DrawArrays*>(ps);
-            osgState->draw_array_first = da->getFirst();
-            osgState->draw_array_count = da->getCount();
-            break;
-        }
         default:
         {
             LOG_E("unsupport osg::PrimitiveSet::Type [%d]", t);
@@ -607,7 +891,7 @@ write_element_array_primitive(osg::Geometry* g, osg::PrimitiveSet* ps, OsgBuildS
         }
     }
     // vertex: full vertex and part indecis
-    if (pmtState->vertexAccessor > -1 && osgState->draw_array_first == -1)
+    if (pmtState->vertexAccessor > -1)
     {
         primits.attributes["POSITION"] = pmtState->vertexAccessor;
     }
@@ -618,7 +902,7 @@ write_element_array_primitive(osg::Geometry* g, osg::PrimitiveSet* ps, OsgBuildS
         osg::Vec3Array* vertexArr = (osg::Vec3Array*)g->getVertexArray();
         primits.attributes["POSITION"] = osgState->model->accessors.size();
         // reuse vertex accessor if multi indecis
-        if (pmtState->vertexAccessor == -1 && osgState->draw_array_first == -1)
+        if (pmtState->vertexAccessor == -1)
         {
             pmtState->vertexAccessor = osgState->model->accessors.size();
         }
@@ -627,11 +911,12 @@ write_element_array_primitive(osg::Geometry* g, osg::PrimitiveSet* ps, OsgBuildS
         expand_bbox3d(osgState->point_max, osgState->point_min, point_max);
         expand_bbox3d(osgState->point_max, osgState->point_min, point_min);
     }
-    // normal
+    // normal, per vertex only
     osg::Vec3Array* normalArr = (osg::Vec3Array*)g->getNormalArray();
-    if (normalArr)
+    if (normalArr && osgState->normals &&
+        normalArr->getNumElements() == g->getVertexArray()->getNumElements())
     {
-        if (pmtState->normalAccessor > -1 && osgState->draw_array_first == -1)
+        if (pmtState->normalAccessor > -1)
         {
             primits.attributes["NORMAL"] = pmtState->normalAccessor;
         }
@@ -641,7 +926,7 @@ write_element_array_primitive(osg::Geometry* g, osg::PrimitiveSet* ps, OsgBuildS
             osg::Vec3f point_min(1e38, 1e38, 1e38);
             primits.attributes["NORMAL"] = osgState->model->accessors.size();
             // reuse vertex accessor if multi indecis
-            if (pmtState->normalAccessor == -1 && osgState->draw_array_first == -1)
+            if (pmtState->normalAccessor == -1)
             {
                 pmtState->normalAccessor = osgState->model->accessors.size();
             }
@@ -652,7 +937,7 @@ write_element_array_primitive(osg::Geometry* g, osg::PrimitiveSet* ps, OsgBuildS
     osg::Vec2Array* texArr = (osg::Vec2Array*)g->getTexCoordArray(0);
     if (texArr)
     {
-        if (pmtState->textcdAccessor > -1 && osgState->draw_array_first == -1)
+        if (pmtState->textcdAccessor > -1)
         {
             primits.attributes["TEXCOORD_0"] = pmtState->textcdAccessor;
         }
@@ -660,7 +945,7 @@ write_element_array_primitive(osg::Geometry* g, osg::PrimitiveSet* ps, OsgBuildS
         {
             primits.attributes["TEXCOORD_0"] = osgState->model->accessors.size();
             // reuse textcoord accessor if multi indecis
-            if (pmtState->textcdAccessor == -1 && osgState->draw_array_first == -1)
+            if (pmtState->textcdAccessor == -1)
             {
                 pmtState->textcdAccessor = osgState->model->accessors.size();
             }
@@ -689,23 +974,847 @@ write_element_array_primitive(osg::Geometry* g, osg::PrimitiveSet* ps, OsgBuildS
     osgState->model->meshes.back().primitives.push_back(primits);
 }
 
+struct NormalSum
+{
+    const osg::Vec3Array* points;
+    osg::Vec3Array* sums;
+
+    void operator()(unsigned i1, unsigned i2, unsigned i3) {
+        unsigned n = points->size();
+        if (i1 >= n || i2 >= n || i3 >= n) {
+            return;
+        }
+        const osg::Vec3f& p1 = (*points)[i1];
+        // twice the triangle area long, the large faces weigh more
+        osg::Vec3f face = ((*points)[i2] - p1) ^ ((*points)[i3] - p1);
+        (*sums)[i1] += face;
+        (*sums)[i2] += face;
+        (*sums)[i3] += face;
+    }
+};
+
+/**
+ * area weighted vertex normals of the triangles of g, in one pass over
+ * the indices instead of the vertex sharing maps of SmoothingVisitor
+*/
+void generate_normals(osg::Geometry* g)
+{
+    osg::Vec3Array* vertex = dynamic_cast<osg::Vec3Array*>(g->getVertexArray());
+    if (!vertex || vertex->empty()) {
+        return;
+    }
+    osg::ref_ptr<osg::Vec3Array> normal = new osg::Vec3Array(vertex->size());
+    osg::TriangleIndexFunctor<NormalSum> sum;
+    sum.points = vertex;
+    sum.sums = normal.get();
+    g->accept(sum);
+    for (auto& n : *normal) {
+        if (n.normalize() == 0) {
+            n.set(0, 0, 1);
+        }
+    }
+    g->setNormalArray(normal.get(), osg::Array::BIND_PER_VERTEX);
+}
+
+struct TriangleList
+{
+    std::vector<unsigned>* triangles;
+
+    void operator()(unsigned i1, unsigned i2, unsigned i3) {
+        triangles->push_back(i1);
+        triangles->push_back(i2);
+        triangles->push_back(i3);
+    }
+};
+
+/**
+ * turns the draw arrays, strips, fans and quads of g into indexed triangle
+ * lists over its vertex arrays, which are then written once per geometry
+ * instead of once per draw arrays. the points and lines are dropped
+*/
+void triangulate_geometry(osg::Geometry* g)
+{
+    for (unsigned k = g->getNumPrimitiveSets(); k-- > 0;) {
+        osg::PrimitiveSet* ps = g->getPrimitiveSet(k);
+        if (ps->getDrawElements() && ps->getMode() == GL_TRIANGLES) {
+            continue;
+        }
+        std::vector<unsigned> triangles;
+        osg::TriangleIndexFunctor<TriangleList> collect;
+        collect.triangles = &triangles;
+        ps->accept(collect);
+        if (triangles.empty()) {
+            g->removePrimitiveSet(k);
+            continue;
+        }
+        g->setPrimitiveSet(k, new osg::DrawElementsUInt(GL_TRIANGLES, triangles.begin(), triangles.end()));
+    }
+}
+
+// the bytes per index write_osg_indecis uses for count vertices
+unsigned index_size(const osg::DrawElements* de, unsigned count)
+{
+    if (dynamic_cast<const osg::DrawElementsUByte*>(de)) {
+        return 1;
+    }
+    if (dynamic_cast<const osg::DrawElementsUShort*>(de)) {
+        return 2;
+    }
+    return count <= 0xffff ? 2 : 4;
+}
+
+// the attributes of a vertex in the glb, equal when bitwise equal
+struct VertexKey
+{
+    float v[8];
+
+    bool operator==(const VertexKey& other) const {
+        return memcmp(v, other.v, sizeof(v)) == 0;
+    }
+};
+
+struct VertexKeyHash
+{
+    size_t operator()(const VertexKey& key) const {
+        return (size_t)image_hash_mix(14695981039346656037ULL, key.v, sizeof(key.v));
+    }
+};
+
+// a triangle rotated to its smallest index, the winding kept
+struct TriangleKey
+{
+    unsigned i[3];
+
+    TriangleKey(unsigned a, unsigned b, unsigned c) {
+        if (b < a && b < c) {
+            i[0] = b; i[1] = c; i[2] = a;
+        }
+        else if (c < a && c < b) {
+            i[0] = c; i[1] = a; i[2] = b;
+        }
+        else {
+            i[0] = a; i[1] = b; i[2] = c;
+        }
+    }
+
+    bool operator==(const TriangleKey& other) const {
+        return i[0] == other.i[0] && i[1] == other.i[1] && i[2] == other.i[2];
+    }
+};
+
+struct TriangleKeyHash
+{
+    size_t operator()(const TriangleKey& key) const {
+        return (size_t)image_hash_mix(14695981039346656037ULL, key.i, sizeof(key.i));
+    }
+};
+
+/**
+ * welds the bitwise equal vertices of the triangle lists of g, drops the
+ * zero area and repeated triangles, then keeps only the referenced vertices.
+ * only the attributes written to the glb are kept, normals is false when
+ * the normals are not written. g is made of triangle lists by
+ * triangulate_geometry
+*/
+void clean_geometry(osg::Geometry* g, bool normals)
+{
+    osg::Vec3Array* vertex = dynamic_cast<osg::Vec3Array*>(g->getVertexArray());
+    if (!vertex || vertex->empty() || g->getNumPrimitiveSets() == 0) {
+        return;
+    }
+    unsigned count = vertex->size();
+    osg::Vec3Array* normal = dynamic_cast<osg::Vec3Array*>(g->getNormalArray());
+    if (!normals || (normal && normal->size() != count)) {
+        normal = NULL;
+    }
+    osg::Vec2Array* uv = dynamic_cast<osg::Vec2Array*>(g->getTexCoordArray(0));
+    if (g->getTexCoordArray(0) && (!uv || uv->size() != count)) {
+        return;
+    }
+    unsigned stride = sizeof(osg::Vec3f) + (normal ? sizeof(osg::Vec3f) : 0) + (uv ? sizeof(osg::Vec2f) : 0);
+    size_t bytes_in = (size_t)count * stride;
+    for (unsigned k = 0; k < g->getNumPrimitiveSets(); k++) {
+        osg::DrawElements* de = g->getPrimitiveSet(k)->getDrawElements();
+        if (!de || de->getMode() != GL_TRIANGLES) {
+            return;
+        }
+        bytes_in += (size_t)de->getNumIndices() * index_size(de, count);
+    }
+    // the first of the equal vertices
+    std::vector<unsigned> weld(count);
+    {
+        std::unordered_map<VertexKey, unsigned, VertexKeyHash> first;
+        first.reserve(count);
+        for (unsigned i = 0; i < count; i++) {
+            VertexKey key = {};
+            memcpy(key.v, &(*vertex)[i], sizeof(osg::Vec3f));
+            if (normal) {
+                memcpy(key.v + 3, &(*normal)[i], sizeof(osg::Vec3f));
+            }
+            if (uv) {
+                memcpy(key.v + 6, &(*uv)[i], sizeof(osg::Vec2f));
+            }
+            weld[i] = first.insert(std::make_pair(key, i)).first->second;
+        }
+    }
+    // the kept triangles, renumbered in the order of first use
+    std::vector<int> remap(count, -1);
+    std::vector<unsigned> order;
+    std::vector<std::vector<unsigned>> triangles(g->getNumPrimitiveSets());
+    std::unordered_set<TriangleKey, TriangleKeyHash> seen;
+    for (unsigned k = 0; k < g->getNumPrimitiveSets(); k++) {
+        osg::DrawElements* de = g->getPrimitiveSet(k)->getDrawElements();
+        for (unsigned t = 0; t + 2 < de->getNumIndices(); t += 3) {
+            unsigned idx[3] = { de->index(t), de->index(t + 1), de->index(t + 2) };
+            if (idx[0] >= count || idx[1] >= count || idx[2] >= count) {
+                continue;
+            }
+            for (auto& i : idx) {
+                i = weld[i];
+            }
+            if (idx[0] == idx[1] || idx[1] == idx[2] || idx[0] == idx[2]) {
+                continue;
+            }
+            const osg::Vec3f& p0 = (*vertex)[idx[0]];
+            if ((((*vertex)[idx[1]] - p0) ^ ((*vertex)[idx[2]] - p0)).length2() == 0) {
+                continue;
+            }
+            if (!seen.insert(TriangleKey(idx[0], idx[1], idx[2])).second) {
+                continue;
+            }
+            for (auto i : idx) {
+                if (remap[i] < 0) {
+                    remap[i] = order.size();
+                    order.push_back(i);
+                }
+                triangles[k].push_back(remap[i]);
+            }
+        }
+    }
+    osg::ref_ptr<osg::Vec3Array> new_vertex = new osg::Vec3Array;
+    osg::ref_ptr<osg::Vec3Array> new_normal = normal ? new osg::Vec3Array : NULL;
+    osg::ref_ptr<osg::Vec2Array> new_uv = uv ? new osg::Vec2Array : NULL;
+    new_vertex->reserve(order.size());
+    for (auto i : order) {
+        new_vertex->push_back((*vertex)[i]);
+        if (normal) {
+            new_normal->push_back((*normal)[i]);
+        }
+        if (uv) {
+            new_uv->push_back((*uv)[i]);
+        }
+    }
+    size_t bytes_out = order.size() * stride;
+    // the compacted indices still fit the type of the triangle lists
+    std::vector<osg::ref_ptr<osg::DrawElements>> sets;
+    for (unsigned k = 0; k < g->getNumPrimitiveSets(); k++) {
+        if (triangles[k].empty()) {
+            continue;
+        }
+        osg::DrawElements* de = g->getPrimitiveSet(k)->getDrawElements();
+        osg::ref_ptr<osg::DrawElements> set = dynamic_cast<osg::DrawElements*>(de->cloneType());
+        set->setMode(GL_TRIANGLES);
+        set->reserveElements(triangles[k].size());
+        for (auto i : triangles[k]) {
+            set->addElement(i);
+        }
+        bytes_out += triangles[k].size() * index_size(set.get(), order.size());
+        sets.push_back(set);
+    }
+    g->removePrimitiveSet(0, g->getNumPrimitiveSets());
+    for (auto& set : sets) {
+        g->addPrimitiveSet(set.get());
+    }
+    g->setVertexArray(new_vertex.get());
+    g->setNormalArray(new_normal.get(), osg::Array::BIND_PER_VERTEX);
+    g->setTexCoordArray(0, new_uv.get(), osg::Array::BIND_PER_VERTEX);
+    mesh_bytes_in += bytes_in;
+    mesh_bytes_out += bytes_out;
+}
+
+// a geometry as written to the glb: triangle lists, cleaned, then its
+// normals per the policy
+void prepare_geometry(osg::Geometry* g, int normals)
+{
+    triangulate_geometry(g);
+    clean_geometry(g, normals == NORMAL_KEEP);
+    if (normals == NORMAL_GENERATE) {
+        generate_normals(g);
+    }
+}
+
+// the primitive sets are indexed triangle lists sharing the vertex accessors
 void write_osgGeometry(osg::Geometry* g, OsgBuildState* osgState)
 {
-    osg::PrimitiveSet::Type t = g->getPrimitiveSet(0)->getType();
     PrimitiveState pmtState = {-1, -1, -1};
     for (unsigned int k = 0; k < g->getNumPrimitiveSets(); k++)
     {
         osg::PrimitiveSet* ps = g->getPrimitiveSet(k);
-        if (t != ps->getType())
-        {
-            LOG_E("PrimitiveSets type are NOT same in osgb");
-            exit(1);
-        }
         write_element_array_primitive(g, ps, osgState, &pmtState);
     }
 }
 
-bool osgb2glb_buf(std::string path, std::string& glb_buff, MeshInfo& mesh_info) {
+/**
+ * the largest texture worth encoding for an inner tile, 0 for no limit.
+ * the client refines a tile once its error covers texture_sse pixels, so
+ * the tile is never drawn larger than extent / error * texture_sse pixels.
+ * get_geometric_error is extent / 20 whatever the box, so this is a fixed
+ * cap of 20 * texture_sse for every inner tile, 512 at sse 16. the errors
+ * calc_geometric_error doubles up single-child levels are larger than
+ * that, those tiles are refined sooner and keep more texture than needed.
+ * a leaf is never refined and keeps its textures
+*/
+int texture_budget(bool leaf) {
+    if (texture_sse <= 0 || leaf) {
+        return 0;
+    }
+    int max_size = 64;
+    while (max_size < 20 * texture_sse && max_size < 8192) {
+        max_size *= 2;
+    }
+    return max_size;
+}
+
+// the uv bounds (max, min) of the indexed vertices of each texture
+typedef std::map<osg::Texture*, std::pair<osg::Vec2f, osg::Vec2f>> UvBounds;
+
+UvBounds texture_uv_bounds(InfoVisitor& infoVisitor) {
+    UvBounds bounds;
+    for (auto g : infoVisitor.geometry_array) {
+        auto tex = infoVisitor.texture_map.find(g);
+        osg::Vec2Array* texArr = dynamic_cast<osg::Vec2Array*>(g->getTexCoordArray(0));
+        if (tex == infoVisitor.texture_map.end() || !texArr) {
+            continue;
+        }
+        auto it = bounds.insert(std::make_pair(tex->second,
+            std::make_pair(osg::Vec2f(-1e38, -1e38), osg::Vec2f(1e38, 1e38)))).first;
+        for (unsigned int k = 0; k < g->getNumPrimitiveSets(); k++) {
+            osg::PrimitiveSet* ps = g->getPrimitiveSet(k);
+            for (unsigned int i = 0; i < ps->getNumIndices(); i++) {
+                unsigned int idx = ps->index(i);
+                if (idx < texArr->size()) {
+                    expand_bbox2d(it->second.first, it->second.second, texArr->at(idx));
+                }
+            }
+        }
+    }
+    return bounds;
+}
+
+// the texture has an image and its uvs stay in [0, 1], it does not repeat
+osg::Image* clamped_image(osg::Texture* tex, const UvBounds& bounds) {
+    const float EPS = 1e-3f;
+    auto b = bounds.find(tex);
+    if (b == bounds.end() || tex->getNumImages() == 0) {
+        return NULL;
+    }
+    const osg::Vec2f& uv_max = b->second.first;
+    const osg::Vec2f& uv_min = b->second.second;
+    if (uv_min.x() < -EPS || uv_min.y() < -EPS || uv_max.x() > 1 + EPS || uv_max.y() > 1 + EPS) {
+        return NULL;
+    }
+    return tex->getImage(0);
+}
+
+/**
+ * the pixels of each texture the uvs of the tile reach, plus crop_padding.
+ * textures with uvs out of [0, 1] repeat and are kept whole
+*/
+std::map<osg::Texture*, TexCrop> texture_crops(const UvBounds& bounds) {
+    std::map<osg::Texture*, TexCrop> crops;
+    for (auto& b : bounds) {
+        osg::Image* img = clamped_image(b.first, bounds);
+        if (!img) {
+            continue;
+        }
+        const osg::Vec2f& uv_max = b.second.first;
+        const osg::Vec2f& uv_min = b.second.second;
+        int w = img->s(), h = img->t();
+        TexCrop crop = {
+            std::max(0, (int)std::floor(uv_min.x() * w) - crop_padding),
+            std::max(0, (int)std::floor(uv_min.y() * h) - crop_padding),
+            std::min(w, (int)std::ceil(uv_max.x() * w) + crop_padding),
+            std::min(h, (int)std::ceil(uv_max.y() * h) + crop_padding)
+        };
+        if (crop.x1 > crop.x0 && crop.y1 > crop.y0
+            && (crop.x1 - crop.x0 < w || crop.y1 - crop.y0 < h)) {
+            crops[b.first] = crop;
+        }
+    }
+    return crops;
+}
+
+// the part of the image a tile uses, all of it without a crop
+TexCrop image_rect(osg::Texture* tex, const std::map<osg::Texture*, TexCrop>& crops) {
+    auto it = crops.find(tex);
+    if (it != crops.end()) {
+        return it->second;
+    }
+    osg::Image* img = tex && tex->getNumImages() > 0 ? tex->getImage(0) : NULL;
+    TexCrop rect = { 0, 0, img ? img->s() : 0, img ? img->t() : 0 };
+    return rect;
+}
+
+/**
+ * pixel rows row_stride bytes apart, in the data of an osg::Image
+ * or in owned, the encoders take them as they are
+*/
+struct Pixels
+{
+    // the osg::Image data, NULL for owned
+    const unsigned char* image;
+    std::vector<unsigned char> owned;
+    size_t offset;
+    int width;
+    int height;
+    int comp;
+    int row_stride;
+
+    Pixels() : image(NULL), offset(0), width(0), height(0), comp(3), row_stride(0) {}
+
+    const unsigned char* data() const {
+        return (image ? image : owned.data()) + offset;
+    }
+
+    bool empty() const {
+        return width <= 0 || height <= 0 || (!image && owned.empty());
+    }
+
+    // keep the pixels [x0, x1) x [y0, y1), no copy
+    void crop(const TexCrop& rect) {
+        offset += rect.y0 * row_stride + rect.x0 * comp;
+        width = rect.x1 - rect.x0;
+        height = rect.y1 - rect.y0;
+    }
+
+    // own the rows packed width * comp bytes apart
+    void pack() {
+        std::vector<unsigned char> buf(width * height * comp);
+        for (int y = 0; y < height; y++) {
+            memcpy(buf.data() + y * width * comp, data() + y * row_stride, width * comp);
+        }
+        owned.swap(buf);
+        image = NULL;
+        offset = 0;
+        row_stride = width * comp;
+    }
+};
+
+/**
+ * the pixels of the image in rect, the rows of the image are used in place,
+ * the DXT1 images are decoded and shrunk to 2048
+*/
+Pixels decode_image(osg::Image* img, const TexCrop& rect) {
+    Pixels pixels;
+    pixels.width = img->s();
+    pixels.height = img->t();
+    bool dxt = img->getPixelSizeInBits() == 4;
+    if (dxt) {
+        fill_4BitImage(pixels.owned, img, pixels.width, pixels.height);
+        pixels.comp = 3;
+        pixels.row_stride = pixels.width * 3;
+    }
+    else {
+        pixels.image = img->data();
+        pixels.comp = img->getPixelSizeInBits() / 8;
+        pixels.row_stride = img->getRowStepInBytes();
+    }
+    if (rect.x1 - rect.x0 < pixels.width || rect.y1 - rect.y0 < pixels.height) {
+        pixels.crop(rect);
+    }
+    if (dxt && std::max(pixels.width, pixels.height) > 2048) {
+        pixels.pack();
+        shrink_image(pixels.owned, pixels.width, pixels.height, 2048);
+        pixels.row_stride = pixels.width * 3;
+    }
+    return pixels;
+}
+
+// resample the pixels down to max_size
+void resize_pixels(Pixels& pixels, int max_size) {
+    int width = pixels.width, height = pixels.height, comp = pixels.comp;
+    if (max_size > 0 && std::max(width, height) > max_size && comp <= 4) {
+        double scale = (double)max_size / std::max(width, height);
+        int new_w = std::max(1, (int)std::lround(width * scale));
+        int new_h = std::max(1, (int)std::lround(height * scale));
+        std::vector<unsigned char> buf;
+        resample_image(pixels.data(), pixels.row_stride, width, height, comp, buf, new_w, new_h);
+        pixels.owned.swap(buf);
+        pixels.image = NULL;
+        pixels.offset = 0;
+        pixels.width = new_w;
+        pixels.height = new_h;
+        pixels.row_stride = new_w * comp;
+    }
+}
+
+const char* texture_mime(int format) {
+    return format == TEX_JPEG ? "image/jpeg" : "image/webp";
+}
+
+// the format of an encoded file, a failed encode may fall back to jpeg
+int image_format(const std::vector<unsigned char>& file, int format) {
+    bool jpeg = file.size() > 2 && file[0] == 0xFF && file[1] == 0xD8;
+    return jpeg ? TEX_JPEG : format;
+}
+
+// a black image for the textures without pixels
+Pixels placeholder_pixels() {
+    Pixels pixels;
+    pixels.width = pixels.height = 256;
+    pixels.row_stride = pixels.width * 3;
+    pixels.owned.resize(pixels.row_stride * pixels.height);
+    return pixels;
+}
+
+// the jpeg or webp file of the pixels, empty if the encoder failed
+ImageBuf encode_image(const Pixels& pixels, int format) {
+    std::shared_ptr<std::vector<unsigned char>> out = std::make_shared<std::vector<unsigned char>>();
+    ImageEncoder* encoder = image_encoder(format);
+    if (!encoder || !encoder->encode(pixels.data(), pixels.width, pixels.height, pixels.comp,
+        pixels.row_stride, texture_quality, *out)) {
+        out->clear();
+    }
+    return out;
+}
+
+/**
+ * a glb image: one texture, or an atlas of the textures at pos,
+ * each one with a gutter of its edge pixels around
+*/
+struct TexImage
+{
+    std::vector<osg::Texture*> textures;
+    std::vector<osg::Vec2i> pos;
+    // the atlas size, 0 for a single texture
+    int width;
+    int height;
+};
+
+// the largest atlas, the textures above half of it are not packed
+static const int atlas_max_size = 4096;
+
+// bottom-left skyline packing, the rects are placed one by one
+struct Skyline
+{
+    struct Node
+    {
+        int x, y, w;
+    };
+    int width;
+    int height;
+    // the top of the placed rects, left to right
+    std::vector<Node> nodes;
+
+    Skyline(int w, int h) : width(w), height(h) {
+        Node node = { 0, 0, w };
+        nodes.push_back(node);
+    }
+
+    // place a w x h rect where its top is the lowest, false if it does not fit
+    bool place(int w, int h, osg::Vec2i& pos) {
+        int best = -1, best_top = INT_MAX, best_y = 0;
+        for (size_t i = 0; i < nodes.size() && nodes[i].x + w <= width; i++) {
+            int y = 0;
+            for (size_t j = i; j < nodes.size() && nodes[j].x < nodes[i].x + w; j++) {
+                y = std::max(y, nodes[j].y);
+            }
+            if (y + h <= height && y + h < best_top) {
+                best = i;
+                best_top = y + h;
+                best_y = y;
+            }
+        }
+        if (best < 0) {
+            return false;
+        }
+        pos = osg::Vec2i(nodes[best].x, best_y);
+        // the rect covers the nodes under it
+        int right = pos.x() + w;
+        std::vector<Node> line(nodes.begin(), nodes.begin() + best);
+        Node top = { pos.x(), best_top, w };
+        line.push_back(top);
+        for (size_t j = best; j < nodes.size(); j++) {
+            Node n = nodes[j];
+            if (n.x + n.w <= right) {
+                continue;
+            }
+            if (n.x < right) {
+                n.w = n.x + n.w - right;
+                n.x = right;
+            }
+            line.push_back(n);
+        }
+        nodes.clear();
+        for (auto& n : line) {
+            if (!nodes.empty() && nodes.back().y == n.y) {
+                nodes.back().w += n.w;
+            }
+            else {
+                nodes.push_back(n);
+            }
+        }
+        return true;
+    }
+};
+
+int next_pow2(int v) {
+    int n = 1;
+    while (n < v) {
+        n *= 2;
+    }
+    return n;
+}
+
+/**
+ * the glb images of the tile, one per texture, or with b_texture_atlas
+ * the clamped rgb textures packed in power of two atlases
+*/
+std::vector<TexImage> pack_textures(InfoVisitor& infoVisitor,
+    const UvBounds& bounds, const std::map<osg::Texture*, TexCrop>& crops)
+{
+    std::vector<TexImage> images;
+    std::vector<osg::Texture*> packed;
+    for (auto tex : infoVisitor.texture_array) {
+        osg::Image* img = b_texture_atlas ? clamped_image(tex, bounds) : NULL;
+        TexCrop rect = image_rect(tex, crops);
+        int bits = img ? img->getPixelSizeInBits() : 0;
+        if ((bits == 4 || bits == 8 || bits == 24)
+            && std::max(rect.x1 - rect.x0, rect.y1 - rect.y0) <= atlas_max_size / 2) {
+            packed.push_back(tex);
+            continue;
+        }
+        TexImage image = { { tex }, { osg::Vec2i(0, 0) }, 0, 0 };
+        images.push_back(image);
+    }
+    // the tallest first
+    auto rect_size = [&crops](osg::Texture* tex) {
+        TexCrop rect = image_rect(tex, crops);
+        return osg::Vec2i(rect.x1 - rect.x0 + 2 * crop_padding, rect.y1 - rect.y0 + 2 * crop_padding);
+    };
+    std::stable_sort(packed.begin(), packed.end(), [&rect_size](osg::Texture* a, osg::Texture* b) {
+        return rect_size(a).y() > rect_size(b).y();
+    });
+    while (!packed.empty()) {
+        size_t area = 0;
+        for (auto tex : packed) {
+            area += (size_t)rect_size(tex).x() * rect_size(tex).y();
+        }
+        int side = 256;
+        while (side < atlas_max_size && (size_t)side * side < area) {
+            side *= 2;
+        }
+        TexImage atlas;
+        std::vector<osg::Texture*> left;
+        while (true) {
+            Skyline sky(side, side);
+            atlas = TexImage{ {}, {}, side, 0 };
+            left.clear();
+            for (auto tex : packed) {
+                osg::Vec2i size = rect_size(tex);
+                osg::Vec2i pos;
+                if (sky.place(size.x(), size.y(), pos)) {
+                    atlas.textures.push_back(tex);
+                    atlas.pos.push_back(pos + osg::Vec2i(crop_padding, crop_padding));
+                    atlas.height = std::max(atlas.height, pos.y() + size.y());
+                }
+                else {
+                    left.push_back(tex);
+                }
+            }
+            if (left.empty() || side == atlas_max_size) {
+                break;
+            }
+            side *= 2;
+        }
+        if (atlas.textures.size() == 1) {
+            atlas.width = 0;
+            atlas.pos[0] = osg::Vec2i(0, 0);
+        }
+        else {
+            atlas.height = next_pow2(atlas.height);
+        }
+        images.push_back(atlas);
+        packed = left;
+    }
+    return images;
+}
+
+// where a texture is in the glb images: TEXCOORD_0 = uv * scale + offset
+struct TexSlot
+{
+    int image;
+    osg::Vec2f scale;
+    osg::Vec2f offset;
+};
+
+std::map<osg::Texture*, TexSlot> texture_slots(
+    const std::vector<TexImage>& images, const std::map<osg::Texture*, TexCrop>& crops)
+{
+    std::map<osg::Texture*, TexSlot> slots;
+    for (size_t i = 0; i < images.size(); i++) {
+        const TexImage& image = images[i];
+        for (size_t k = 0; k < image.textures.size(); k++) {
+            osg::Texture* tex = image.textures[k];
+            TexSlot slot = { (int)i, osg::Vec2f(1, 1), osg::Vec2f(0, 0) };
+            TexCrop rect = image_rect(tex, crops);
+            osg::Image* img = tex && tex->getNumImages() > 0 ? tex->getImage(0) : NULL;
+            if (img && rect.x1 > rect.x0 && rect.y1 > rect.y0) {
+                // uv 1 is the far edge of the s x t image, the rect lands at pos
+                // in the atlas or fills the image
+                float w = image.width ? image.width : rect.x1 - rect.x0;
+                float h = image.width ? image.height : rect.y1 - rect.y0;
+                slot.scale = osg::Vec2f(img->s() / w, img->t() / h);
+                slot.offset = osg::Vec2f((image.pos[k].x() - rect.x0) / w, (image.pos[k].y() - rect.y0) / h);
+            }
+            slots[tex] = slot;
+        }
+    }
+    return slots;
+}
+
+// copy the pixels into the rgb atlas at pos, the edges spread over the gutter
+void blit_atlas(std::vector<unsigned char>& atlas, int atlas_w, int atlas_h,
+    const Pixels& pixels, osg::Vec2i pos)
+{
+    int width = pixels.width, height = pixels.height, comp = pixels.comp;
+    for (int y = -crop_padding; y < height + crop_padding; y++) {
+        int sy = std::min(std::max(y, 0), height - 1);
+        if (pos.y() + y < 0 || pos.y() + y >= atlas_h) continue;
+        for (int x = -crop_padding; x < width + crop_padding; x++) {
+            int sx = std::min(std::max(x, 0), width - 1);
+            if (pos.x() + x < 0 || pos.x() + x >= atlas_w) continue;
+            const unsigned char* src = pixels.data() + sy * pixels.row_stride + sx * comp;
+            unsigned char* dst = atlas.data() + ((pos.y() + y) * atlas_w + pos.x() + x) * 3;
+            for (int c = 0; c < 3; c++) {
+                dst[c] = src[comp == 1 ? 0 : c];
+            }
+        }
+    }
+}
+
+// the pixels of a texture or of an atlas
+Pixels decode_tex_image(const TexImage& image, const std::map<osg::Texture*, TexCrop>& crops, size_t& jpeg_mem)
+{
+    if (!image.width) {
+        osg::Texture* tex = image.textures[0];
+        Pixels pixels = decode_image(tex->getImage(0), image_rect(tex, crops));
+        jpeg_mem = std::max(jpeg_mem, pixels.owned.capacity());
+        return pixels;
+    }
+    Pixels atlas;
+    atlas.width = image.width;
+    atlas.height = image.height;
+    atlas.comp = 3;
+    atlas.row_stride = atlas.width * 3;
+    atlas.owned.resize(atlas.width * atlas.height * 3);
+    size_t decoded = 0;
+    for (size_t k = 0; k < image.textures.size(); k++) {
+        osg::Texture* tex = image.textures[k];
+        Pixels pixels = decode_image(tex->getImage(0), image_rect(tex, crops));
+        decoded = std::max(decoded, pixels.owned.capacity());
+        if (!pixels.empty()) {
+            blit_atlas(atlas.owned, atlas.width, atlas.height, pixels, image.pos[k]);
+        }
+    }
+    jpeg_mem = std::max(jpeg_mem, atlas.owned.capacity() + decoded);
+    return atlas;
+}
+
+/**
+ * the image in each of the formats, from the texture cache if its pixels
+ * were seen before. crops are the pixels of the textures the tile uses
+*/
+std::vector<ImageBuf> encode_texture(const TexImage& image, const std::map<osg::Texture*, TexCrop>& crops,
+    int max_size, const std::vector<int>& formats, size_t& image_mem, size_t& jpeg_mem)
+{
+    // an atlas is keyed by its textures and their places
+    uint64_t key = 14695981039346656037ULL;
+    bool valid = true;
+    for (size_t k = 0; k < image.textures.size(); k++) {
+        osg::Texture* tex = image.textures[k];
+        osg::Image* img = tex && tex->getNumImages() > 0 ? tex->getImage(0) : NULL;
+        if (!img) {
+            valid = false;
+            break;
+        }
+        image_mem += img->getTotalSizeInBytes();
+        uint64_t h = image_hash(img, image_rect(tex, crops), max_size);
+        int place[4] = { image.pos[k].x(), image.pos[k].y(), image.width, image.height };
+        h = image.width ? image_hash_mix(h, place, sizeof(place)) : h;
+        key = image.textures.size() > 1 ? image_hash_mix(key, &h, sizeof(h)) : h;
+    }
+    std::vector<ImageBuf> out(formats.size());
+    std::vector<uint64_t> keys(formats.size());
+    bool missing = !valid;
+    for (size_t i = 0; i < formats.size() && valid; i++) {
+        int format[2] = { formats[i], texture_quality };
+        keys[i] = image_hash_mix(key, format, sizeof(format));
+        out[i] = texture_cache.get(keys[i]);
+        missing = missing || !out[i];
+    }
+    if (!missing) {
+        return out;
+    }
+    Pixels pixels;
+    if (valid) {
+        pixels = decode_tex_image(image, crops, jpeg_mem);
+    }
+    if (pixels.empty()) {
+        valid = false;
+        pixels = placeholder_pixels();
+    }
+    else {
+        resize_pixels(pixels, max_size);
+    }
+    for (size_t i = 0; i < formats.size(); i++) {
+        if (!out[i]) {
+            out[i] = encode_image(pixels, formats[i]);
+            // an empty file is an invalid glb image, it is not cached
+            // so the texture is encoded again by the next tile
+            bool encoded = !out[i]->empty();
+            if (!encoded) {
+                LOG_E("texture encode failed, a black image is used");
+                out[i] = encode_image(placeholder_pixels(), formats[i]);
+            }
+            // the glb texture takes a jpeg by its plain source, not as webp
+            if (out[i]->empty()) {
+                out[i] = encode_image(placeholder_pixels(), TEX_JPEG);
+            }
+            if (valid && encoded) {
+                texture_cache.put(keys[i], out[i]);
+            }
+        }
+    }
+    return out;
+}
+
+// the files of one glb image, encoded on the encode_pool
+struct EncodeJob
+{
+    std::vector<ImageBuf> files;
+    size_t image_mem;
+    size_t jpeg_mem;
+    TaskPool::TaskPtr task;
+};
+
+// the encodes of a tile, all done before the osg tree they read is released
+struct EncodeJobs
+{
+    std::vector<std::shared_ptr<EncodeJob>> jobs;
+
+    ~EncodeJobs() {
+        for (auto& job : jobs) {
+            task_pool().wait(job->task);
+        }
+    }
+};
+
+/**
+ * a leaf keeps its textures, the other tiles are limited by the texture
+ * budget. an osgb without PagedLOD children is always a leaf
+*/
+bool osgb2glb_buf(std::string path, std::string& glb_buff, MeshInfo& mesh_info, bool leaf) {
     vector<string> fileNames = { path };
     std::string parent_path = get_parent(path);
     osg::ref_ptr<osg::Node> root = osgDB::readNodeFiles(fileNames);
@@ -717,8 +1826,11 @@ bool osgb2glb_buf(std::string path, std::string& glb_buff, MeshInfo& mesh_info)
     if (infoVisitor.geometry_array.empty())
         return false;
 
-    osgUtil::SmoothingVisitor sv;
-    root->accept(sv);
+    int normals = normal_mode;
+    if (normals == NORMAL_AUTO) {
+        // the materials are KHR_materials_unlit, the clients ignore normals
+        normals = b_pbr_texture ? NORMAL_GENERATE : NORMAL_NONE;
+    }
 
     tinygltf::TinyGLTF gltf;
     tinygltf::Model model;
@@ -726,35 +1838,77 @@ bool osgb2glb_buf(std::string path, std::string& glb_buff, MeshInfo& mesh_info)
 
     osg::Vec3f point_max, point_min;
     OsgBuildState osgState = {
-        &buffer, &model, osg::Vec3f(-1e38,-1e38,-1e38), osg::Vec3f(1e38,1e38,1e38), -1, -1
+        &buffer, &model, osg::Vec3f(-1e38,-1e38,-1e38), osg::Vec3f(1e38,1e38,1e38),
+        osg::Vec2f(1, 1), osg::Vec2f(0, 0), normals != NORMAL_NONE
     };
+    UvBounds uv_bounds;
+    std::map<osg::Texture*, TexCrop> crops;
+    if (b_texture_crop || b_texture_atlas) {
+        uv_bounds = texture_uv_bounds(infoVisitor);
+    }
+    if (b_texture_crop) {
+        crops = texture_crops(uv_bounds);
+    }
+    std::vector<TexImage> tex_images = pack_textures(infoVisitor, uv_bounds, crops);
+    std::map<osg::Texture*, TexSlot> slots = texture_slots(tex_images, crops);
+    // the textures are encoded on the task_pool while the geometry is written
+    int max_size = texture_budget(leaf || infoVisitor.sub_node_names.empty());
+    // the geometries are cleaned and their normals made on the task_pool,
+    // a geometry shared by several geodes is visited more than once
+    std::vector<TaskPool::TaskPtr> mesh_tasks;
+    {
+        std::set<osg::Geometry*> geometries(
+            infoVisitor.geometry_array.begin(), infoVisitor.geometry_array.end());
+        for (auto g : geometries) {
+            mesh_tasks.push_back(task_pool().submit(std::bind(prepare_geometry, g, normals)));
+        }
+    }
+    // the webp image then its jpeg fallback
+    std::vector<int> formats = { texture_format };
+    if (b_texture_fallback) {
+        formats.push_back(TEX_JPEG);
+    }
+    EncodeJobs encodes;
+    for (auto& tex_image : tex_images)
+    {
+        std::shared_ptr<EncodeJob> job = std::make_shared<EncodeJob>();
+        job->image_mem = job->jpeg_mem = 0;
+        EncodeJob* out = job.get();
+        const TexImage* image = &tex_image;
+        job->task = task_pool().submit([out, image, &crops, max_size, &formats]() {
+            out->files = encode_texture(*image, crops, max_size, formats, out->image_mem, out->jpeg_mem);
+        });
+        encodes.jobs.push_back(job);
+    }
+    for (auto& task : mesh_tasks) {
+        task_pool().wait(task);
+    }
     // mesh
     model.meshes.resize(1);
     int primitive_idx = 0;
     for (auto g : infoVisitor.geometry_array)
     {
-        if (!g->getVertexArray() || g->getVertexArray()->getDataSize() == 0)
+        // no triangle left after clean_geometry
+        if (!g->getVertexArray() || g->getVertexArray()->getDataSize() == 0 ||
+            g->getNumPrimitiveSets() == 0)
             continue;
 
+        auto slot = slots.find(infoVisitor.texture_map[g]);
+        osgState.uv_scale = osg::Vec2f(1, 1);
+        osgState.uv_offset = osg::Vec2f(0, 0);
+        if (slot != slots.end()) {
+            osgState.uv_scale = slot->second.scale;
+            osgState.uv_offset = slot->second.offset;
+        }
         write_osgGeometry(g, &osgState);
-        // update primitive material index
-        if (infoVisitor.texture_array.size())
+        // update primitive material index, one material per image
+        for (unsigned int k = 0; k < g->getNumPrimitiveSets(); k++)
         {
-            for (unsigned int k = 0; k < g->getNumPrimitiveSets(); k++)
+            if (slot != slots.end())
             {
-                auto tex = infoVisitor.texture_map[g];
-                // if hava texture
-                if (tex)
-                {
-                    for (auto texture : infoVisitor.texture_array)
-                    {
-                        model.meshes[0].primitives[primitive_idx].material++;
-                        if (tex == texture)
-                            break;
-                    }
-                }
-                primitive_idx++;
+                model.meshes[0].primitives[primitive_idx].material = slot->second.image;
             }
+            primitive_idx++;
         }
     }
     // empty geometry or empty vertex-array
@@ -771,68 +1925,47 @@ bool osgb2glb_buf(std::string path, std::string& glb_buff, MeshInfo& mesh_info)
         osgState.point_max.y(),
         osgState.point_max.z()
     };
-    // image
+    // decoded images stay with the osg tree, the textures encoding
+    // together hold their decoded pixels
+    size_t image_mem = 0;
+    size_t jpeg_mem = 0;
+    // image, in the order of tex_images whichever encode ends first,
+    // with the format of each image as a failed encode may be jpeg
+    std::vector<int> image_formats;
     {
-        for (auto tex : infoVisitor.texture_array)
+        for (auto& job : encodes.jobs)
         {
-            unsigned buffer_start = buffer.data.size();
-            std::vector<unsigned char> jpeg_buf;
-            jpeg_buf.reserve(512 * 512 * 3);
-            int width, height, comp;
-            if (tex) {
-                if (tex->getNumImages() > 0) {
-                    osg::Image* img = tex->getImage(0);
-                    if (img) {
-                        width = img->s();
-                        height = img->t();
-                        comp = img->getPixelSizeInBits();
-                        if (comp == 8) comp = 1;
-                        if (comp == 24) comp = 3;
-                        if (comp == 4) {
-                            comp = 3;
-                            fill_4BitImage(jpeg_buf, img, width, height);
-                        }
-                        else
-                        {
-                            unsigned row_step = img->getRowStepInBytes();
-                            unsigned row_size = img->getRowSizeInBytes();
-                            for (size_t i = 0; i < height; i++)
-                            {
-                                jpeg_buf.insert(jpeg_buf.end(),
-                                    img->data() + row_step * i,
-                                    img->data() + row_step * i + row_size);
-                            }
-                        }
-                    }
-                }
-            }
-            if (!jpeg_buf.empty()) {
-                int buf_size = buffer.data.size();
-                buffer.data.reserve(buffer.data.size() + width * height * comp);
-                stbi_write_jpg_to_func(write_buf, &buffer.data, width, height, comp, jpeg_buf.data(), 80);
-            }
-            else {
-                std::vector<char> v_data;
-                width = height = 256;
-                v_data.resize(width * height * 3);
-                stbi_write_jpg_to_func(write_buf, &buffer.data, width, height, 3, v_data.data(), 80);
+            task_pool().wait(job->task);
+            image_mem += job->image_mem;
+            jpeg_mem += job->jpeg_mem;
+            std::vector<ImageBuf>& files = job->files;
+            for (size_t i = 0; i < files.size(); i++)
+            {
+                unsigned buffer_start = buffer.data.size();
+                buffer.data.insert(buffer.data.end(), files[i]->begin(), files[i]->end());
+                tinygltf::Image image;
+                image_formats.push_back(image_format(*files[i], formats[i]));
+                image.mimeType = texture_mime(image_formats.back());
+                image.bufferView = model.bufferViews.size();
+                model.images.push_back(image);
+                tinygltf::BufferView bfv;
+                bfv.buffer = 0;
+                bfv.byteOffset = buffer_start;
+                alignment_buffer(buffer.data);
+                bfv.byteLength = buffer.data.size() - buffer_start;
+                model.bufferViews.push_back(bfv);
             }
-            tinygltf::Image image;
-            image.mimeType = "image/jpeg";
-            image.bufferView = model.bufferViews.size();
-            model.images.push_back(image);
-            tinygltf::BufferView bfv;
-            bfv.buffer = 0;
-            bfv.byteOffset = buffer_start;
-            alignment_buffer(buffer.data);
-            bfv.byteLength = buffer.data.size() - buffer_start;
-            model.bufferViews.push_back(bfv);
         }
     }
     // node
     {
         tinygltf::Node node;
         node.mesh = 0;
+        if (b_glb_content) {
+            // the glb content of 3D Tiles 1.1 is y-up, it has no gltfUpAxis:
+            // -90 degrees around x turns the z-up osgb, (x, y, z) -> (x, z, -y)
+            node.rotation = { -0.70710678118654752, 0, 0, 0.70710678118654752 };
+        }
         model.nodes.push_back(node);
     }
     // scene
@@ -854,7 +1987,14 @@ bool osgb2glb_buf(std::string path, std::string& glb_buff, MeshInfo& mesh_info)
     // use KHR_materials_unlit
     model.extensionsRequired = { "KHR_materials_unlit" };
     model.extensionsUsed = { "KHR_materials_unlit" };
-    for (int i = 0 ; i < infoVisitor.texture_array.size(); i++)
+    bool webp = (size_t)std::count(image_formats.begin(), image_formats.end(), TEX_JPEG) < image_formats.size();
+    if (webp) {
+        model.extensionsUsed.push_back("EXT_texture_webp");
+        if (!b_texture_fallback) {
+            model.extensionsRequired.push_back("EXT_texture_webp");
+        }
+    }
+    for (int i = 0 ; i < tex_images.size(); i++)
     {
         tinygltf::Material mat = make_color_material_osgb(1.0, 1.0, 1.0);
         mat.b_unlit = true; // use KHR_materials_unlit
@@ -869,10 +2009,19 @@ bool osgb2glb_buf(std::string path, std::string& glb_buff, MeshInfo& mesh_info)
     // texture
     {
         int texture_index = 0;
-        for (auto tex : infoVisitor.texture_array)
+        for (size_t i = 0; i < tex_images.size(); i++)
         {
+            // the webp image then its jpeg fallback, a webp which failed to
+            // encode is a jpeg placeholder and only the plain source
             tinygltf::Texture texture;
-            texture.source = texture_index++;
+            for (size_t k = 0; k < formats.size(); k++, texture_index++) {
+                if (image_formats[texture_index] != TEX_JPEG) {
+                    texture.webp_source = texture_index;
+                }
+                else if (texture.source < 0) {
+                    texture.source = texture_index;
+                }
+            }
             texture.sampler = 0;
             model.textures.push_back(texture);
         }
@@ -881,16 +2030,19 @@ bool osgb2glb_buf(std::string path, std::string& glb_buff, MeshInfo& mesh_info)
     model.asset.generator = "fanvanzh";
 
     glb_buff = gltf.Serialize(&model);
+    // the model buffer, the glb and its b3dm copy are alive together
+    size_t mem = image_mem + jpeg_mem + model.buffers[0].data.size() + glb_buff.size() * 2;
+    tile_peak_mem = std::max(tile_peak_mem, mem);
     return true;
 }
 
-bool osgb2b3dm_buf(std::string path, std::string& b3dm_buf, TileBox& tile_box)
+bool osgb2b3dm_buf(std::string path, std::string& b3dm_buf, TileBox& tile_box, bool leaf)
 {
     using nlohmann::json;
 
     std::string glb_buf;
     MeshInfo minfo;
-    bool ret = osgb2glb_buf(path, glb_buf, minfo);
+    bool ret = osgb2glb_buf(path, glb_buf, minfo, leaf);
     if (!ret)
         return false;
 
@@ -970,19 +2122,34 @@ std::vector<double> convert_bbox(TileBox tile) {
     return v;
 }
 
+void convert_tile(osg_tree& tree, const std::string& out_path) {
+    std::string tile_buf;
+    bool leaf = tree.sub_nodes.empty();
+    if (b_glb_content) {
+        // one dummy feature per tile, no feature id is needed
+        MeshInfo minfo;
+        if (osgb2glb_buf(tree.file_name, tile_buf, minfo, leaf)) {
+            tree.bbox.max = minfo.max;
+            tree.bbox.min = minfo.min;
+        }
+    }
+    else {
+        osgb2b3dm_buf(tree.file_name, tile_buf, tree.bbox, leaf);
+    }
+    std::string out_file = out_path;
+    out_file += "/";
+    out_file += replace(get_file_name(tree.file_name),".osgb",
+        b_glb_content ? ".glb" : ".b3dm");
+    if (!tile_buf.empty()) {
+        write_file(out_file.c_str(), tile_buf.data(), tile_buf.size());
+    }
+}
+
 void do_tile_job(osg_tree& tree, std::string out_path, int max_lvl) {
-    std::string json_str;
     if (tree.file_name.empty()) return;
     int lvl = get_lvl_num(tree.file_name);
     if (lvl > max_lvl) return;
-    std::string b3dm_buf;
-    osgb2b3dm_buf(tree.file_name, b3dm_buf, tree.bbox);
-    std::string out_file = out_path;
-    out_file += "/";
-    out_file += replace(get_file_name(tree.file_name),".osgb",".b3dm");
-    if (!b3dm_buf.empty()) {
-        write_file(out_file.c_str(), b3dm_buf.data(), b3dm_buf.size());
-    }
+    convert_tile(tree, out_path);
     // test
     // std::string glb_buf;
     // std::vector<mesh_info> v_info;
@@ -995,6 +2162,44 @@ void do_tile_job(osg_tree& tree, std::string out_path, int max_lvl) {
     }
 }
 
+// convert the nodes of one level, the root (no _L) is level -1
+void do_level_job(osg_tree& tree, const std::string& out_path, int lvl) {
+    if (tree.file_name.empty()) return;
+    int n = get_lvl_num(tree.file_name);
+    if (n > lvl) return;
+    if (n == lvl) {
+        convert_tile(tree, out_path);
+    }
+    for (auto& i : tree.sub_nodes) {
+        do_level_job(i, out_path, lvl);
+    }
+}
+
+// the smallest level after lvl, INT_MAX if there is none
+int next_lvl_num(osg_tree& tree, int lvl) {
+    int n = get_lvl_num(tree.file_name);
+    if (n > lvl) return n;
+    int next = INT_MAX;
+    for (auto& i : tree.sub_nodes) {
+        next = std::min(next, next_lvl_num(i, lvl));
+    }
+    return next;
+}
+
+// drop the nodes finer than lvl, they are not converted yet
+void prune_tree(osg_tree& tree, int lvl) {
+    auto& nodes = tree.sub_nodes;
+    for (size_t i = 0; i < nodes.size();) {
+        if (get_lvl_num(nodes[i].file_name) > lvl) {
+            nodes.erase(nodes.begin() + i);
+        }
+        else {
+            prune_tree(nodes[i], lvl);
+            i++;
+        }
+    }
+}
+
 void expend_box(TileBox& box, TileBox& box_new) {
     if (box_new.max.empty() || box_new.min.empty()) {
         return;
@@ -1109,7 +2314,7 @@ encode_tile_json(osg_tree& tree, double x, double y)
     // Data/Tile_0/Tile_0.b3dm
     std::string uri_path = "./";
     uri_path += file_name;
-    std::string uri = replace(uri_path,".osgb",".b3dm");
+    std::string uri = replace(uri_path,".osgb", b_glb_content ? ".glb" : ".b3dm");
     tile += "\"";
     tile += uri;
     tile += "\",";
@@ -1128,11 +2333,36 @@ encode_tile_json(osg_tree& tree, double x, double y)
     return tile;
 }
 
-/***/
+void* encode_root_json(osg_tree& root, const char* in_path,
+                    double *box, int* len, double x, double y)
+{
+    extend_tile_box(root);
+    if (root.bbox.max.empty() || root.bbox.min.empty())
+    {
+        LOG_E( "[%s] bbox is empty!", in_path);
+        return NULL;
+    }
+    // prevent for root node disappear
+    calc_geometric_error(root);
+    root.geometricError = 1000.0;
+    std::string json = encode_tile_json(root,x,y);
+    root.bbox.extend(0.2);
+    memcpy(box, root.bbox.max.data(), 3 * sizeof(double));
+    memcpy(box + 3, root.bbox.min.data(), 3 * sizeof(double));
+    void* str = malloc(json.length());
+    memcpy(str, json.c_str(), json.length());
+    *len = json.length();
+    return str;
+}
+
+/**
+ * peak_mem is the estimated peak memory of the largest osgb in the tree
+*/
 extern "C" void* 
 osgb23dtile_path(const char* in_path, const char* out_path,
                     double *box, int* len, double x, double y,
-                    int max_lvl, bool pbr_texture)
+                    int max_lvl, bool pbr_texture, bool glb_content,
+                    unsigned long long* peak_mem)
 {
     std::string path = osg_string(in_path);
     osg_tree root = get_all_tree(path);
@@ -1142,20 +2372,136 @@ osgb23dtile_path(const char* in_path, const char* out_path,
         return NULL;
     }
     b_pbr_texture = pbr_texture;
+    b_glb_content = glb_content;
+    tile_peak_mem = 0;
     do_tile_job(root, out_path, max_lvl);
-    extend_tile_box(root);
-    if (root.bbox.max.empty() || root.bbox.min.empty())
+    *peak_mem = tile_peak_mem;
+    return encode_root_json(root, in_path, box, len, x, y);
+}
+
+/**
+ * progressive mode, the tree is read once and converted level by level
+*/
+extern "C" void*
+osgb23dtile_open(const char* in_path)
+{
+    std::string path = osg_string(in_path);
+    osg_tree* root = new osg_tree(get_all_tree(path));
+    if (root->file_name.empty())
     {
-        LOG_E( "[%s] bbox is empty!", in_path);
+        LOG_E( "open file [%s] fail!", in_path);
+        delete root;
         return NULL;
     }
-    // prevent for root node disappear
-    calc_geometric_error(root);
-    root.geometricError = 1000.0;
-    std::string json = encode_tile_json(root,x,y);
-    root.bbox.extend(0.2);
-    memcpy(box, root.bbox.max.data(), 3 * sizeof(double));
-    memcpy(box + 3, root.bbox.min.data(), 3 * sizeof(double));
+    return root;
+}
+
+extern "C" void
+osgb23dtile_close(void* tree)
+{
+    delete (osg_tree*)tree;
+}
+
+extern "C" int
+osgb23dtile_next_level(void* tree, int lvl)
+{
+    return next_lvl_num(*(osg_tree*)tree, lvl);
+}
+
+/**
+ * convert the level lvl, the json is the tree converted so far
+*/
+extern "C" void*
+osgb23dtile_level(void* tree, const char* in_path, const char* out_path,
+                    double *box, int* len, double x, double y,
+                    int lvl, bool pbr_texture, bool glb_content,
+                    unsigned long long* peak_mem)
+{
+    osg_tree& root = *(osg_tree*)tree;
+    b_pbr_texture = pbr_texture;
+    b_glb_content = glb_content;
+    tile_peak_mem = 0;
+    do_level_job(root, out_path, lvl);
+    *peak_mem = tile_peak_mem;
+    // the boxes and errors are recalculated on a copy at every level
+    osg_tree part = root;
+    prune_tree(part, lvl);
+    return encode_root_json(part, in_path, box, len, x, y);
+}
+
+/**
+ * the content of osgb23dtile_buf, set once before the tile server starts
+ * so the request threads only read it
+*/
+extern "C" void
+osgb_content_options(bool pbr_texture, bool glb_content)
+{
+    b_pbr_texture = pbr_texture;
+    b_glb_content = glb_content;
+}
+
+/**
+ * one tile for the tile server, NULL if the osgb has no mesh
+*/
+extern "C" void*
+osgb23dtile_buf(const char* in_path, int* len)
+{
+    std::string path = osg_string(in_path);
+    std::string tile_buf;
+    // the leaves are the osgb without PagedLOD children
+    if (b_glb_content) {
+        MeshInfo minfo;
+        osgb2glb_buf(path, tile_buf, minfo, false);
+    }
+    else {
+        TileBox tile_box;
+        osgb2b3dm_buf(path, tile_buf, tile_box, false);
+    }
+    if (tile_buf.empty()) {
+        return NULL;
+    }
+    void* buf = malloc(tile_buf.size());
+    memcpy(buf, tile_buf.data(), tile_buf.size());
+    *len = tile_buf.size();
+    return buf;
+}
+
+std::string sphere_json(const osg::BoundingSphere& bound) {
+    char buf[256];
+    sprintf(buf, "[%f,%f,%f,%f]",
+        bound.center().x(), bound.center().y(), bound.center().z(), bound.radius());
+    return buf;
+}
+
+/**
+ * the bounding sphere of an osgb and of its PagedLOD children,
+ * read without converting anything:
+ * {"sphere":[x,y,z,r],"children":[{"file":"xx.osgb","sphere":[..]}]}
+*/
+extern "C" void*
+osgb_node_json(const char* in_path, int* len)
+{
+    std::string path = osg_string(in_path);
+    InfoVisitor infoVisitor(get_parent(path));
+    osg::ref_ptr<osg::Node> root = osgDB::readNodeFile(path);
+    if (!root) {
+        LOG_E("read node file [%s] fail!", in_path);
+        return NULL;
+    }
+    root->accept(infoVisitor);
+    std::string json = "{\"sphere\":";
+    json += sphere_json(root->getBound());
+    json += ",\"children\":[";
+    for (size_t i = 0; i < infoVisitor.sub_node_names.size(); i++) {
+        json += "{\"file\":\"";
+        json += utf8_string(get_file_name(infoVisitor.sub_node_names[i]).c_str());
+        json += "\",\"sphere\":";
+        json += sphere_json(infoVisitor.sub_node_bounds[i]);
+        json += "},";
+    }
+    if (json.back() == ',')
+        json.pop_back();
+    json += "]}";
     void* str = malloc(json.length());
     memcpy(str, json.c_str(), json.length());
     *len = json.length();
@@ -1169,7 +2515,7 @@ osgb2glb(const char* in, const char* out)
     MeshInfo minfo;
     std::string glb_buf;
     std::string path = osg_string(in);
-    bool ret = osgb2glb_buf(path, glb_buf, minfo);
+    bool ret = osgb2glb_buf(path, glb_buf, minfo, true);
     if (!ret)
     {
         LOG_E("convert to glb failed");
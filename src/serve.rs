@@ -0,0 +1,155 @@
+//! `--serve`: one warm process converting the jobs posted to a local HTTP API.
+//! The jobs run one after the other, each one on the whole rayon pool.
+//!
+//! POST /jobs       {"format": "osgb", "input": .., "output": .., "config": {..}}
+//! GET  /jobs       the status of all the jobs
+//! GET  /jobs/<id>  the status of one job
+
+use std::collections::VecDeque;
+use std::io;
+use std::net::TcpStream;
+use std::sync::atomic::Ordering;
+use std::sync::{Arc, Condvar, Mutex};
+use std::thread;
+use std::time::Instant;
+
+use http::{respond_json, Request};
+use osgb::Progress;
+
+/// converts one job, the same fields as the command line
+pub type Runner = fn(&::serde_json::Value, Arc<Progress>) -> bool;
+
+#[derive(Clone, Copy, PartialEq)]
+enum JobState {
+    Queued,
+    Running,
+    Done,
+    Failed,
+}
+
+struct Job {
+    id: usize,
+    request: ::serde_json::Value,
+    state: JobState,
+    progress: Arc<Progress>,
+    submitted: Instant,
+    started: Option<Instant>,
+    finished: Option<Instant>,
+}
+
+struct Queue {
+    jobs: Mutex<Vec<Job>>,
+    // the index of the queued jobs
+    pending: Mutex<VecDeque<usize>>,
+    cond: Condvar,
+}
+
+fn seconds(from: Instant, to: Instant) -> f64 {
+    let d = to.duration_since(from);
+    d.as_secs() as f64 + d.subsec_nanos() as f64 * 1e-9
+}
+
+impl Job {
+    fn status(&self) -> ::serde_json::Value {
+        let now = Instant::now();
+        let state = match self.state {
+            JobState::Queued => "queued",
+            JobState::Running => "running",
+            JobState::Done => "done",
+            JobState::Failed => "failed",
+        };
+        json!({
+            "id": self.id,
+            "state": state,
+            "request": self.request,
+            "progress": {
+                "done": self.progress.done.load(Ordering::SeqCst),
+                "total": self.progress.total.load(Ordering::SeqCst)
+            },
+            "wait": seconds(self.submitted, self.started.unwrap_or(now)),
+            "elapsed": self.started.map(|t| seconds(t, self.finished.unwrap_or(now)))
+        })
+    }
+}
+
+fn run_jobs(queue: Arc<Queue>, runner: Runner) {
+    loop {
+        let id = {
+            let mut pending = queue.pending.lock().unwrap();
+            while pending.is_empty() {
+                pending = queue.cond.wait(pending).unwrap();
+            }
+            pending.pop_front().unwrap()
+        };
+        let (request, progress) = {
+            let mut jobs = queue.jobs.lock().unwrap();
+            let job = &mut jobs[id];
+            job.state = JobState::Running;
+            job.started = Some(Instant::now());
+            (job.request.clone(), job.progress.clone())
+        };
+        info!("job {} started", id);
+        let ok = runner(&request, progress);
+        let mut jobs = queue.jobs.lock().unwrap();
+        let job = &mut jobs[id];
+        job.state = if ok { JobState::Done } else { JobState::Failed };
+        job.finished = Some(Instant::now());
+        info!("job {} {}", id, if ok { "done" } else { "failed" });
+    }
+}
+
+fn handle(queue: &Queue, req: Request, stream: &mut TcpStream) -> io::Result<()> {
+    let path: Vec<&str> = req.path.split('/').filter(|s| !s.is_empty()).collect();
+    match (req.method.as_str(), path.as_slice()) {
+        ("POST", ["jobs"]) => {
+            let request: ::serde_json::Value = match ::serde_json::from_slice(&req.body) {
+                Ok(v) => v,
+                Err(e) => return respond_json(stream, 400, &json!({ "error": e.to_string() })),
+            };
+            if !request["input"].is_string() || !request["output"].is_string() {
+                return respond_json(stream, 400, &json!({ "error": "input and output are needed" }));
+            }
+            let id = {
+                let mut jobs = queue.jobs.lock().unwrap();
+                let id = jobs.len();
+                jobs.push(Job {
+                    id: id,
+                    request: request,
+                    state: JobState::Queued,
+                    progress: Arc::new(Progress::default()),
+                    submitted: Instant::now(),
+                    started: None,
+                    finished: None,
+                });
+                id
+            };
+            queue.pending.lock().unwrap().push_back(id);
+            queue.cond.notify_one();
+            respond_json(stream, 201, &json!({ "id": id }))
+        }
+        ("GET", ["jobs"]) => {
+            let jobs = queue.jobs.lock().unwrap();
+            let list: Vec<_> = jobs.iter().map(|j| j.status()).collect();
+            respond_json(stream, 200, &json!(list))
+        }
+        ("GET", ["jobs", id]) => {
+            let jobs = queue.jobs.lock().unwrap();
+            match id.parse::<usize>().ok().and_then(|id| jobs.get(id)) {
+                Some(job) => respond_json(stream, 200, &job.status()),
+                None => respond_json(stream, 404, &json!({ "error": "no such job" })),
+            }
+        }
+        _ => respond_json(stream, 404, &json!({ "error": "not found" })),
+    }
+}
+
+pub fn run(addr: &str, runner: Runner) -> io::Result<()> {
+    let queue = Arc::new(Queue {
+        jobs: Mutex::new(vec![]),
+        pending: Mutex::new(VecDeque::new()),
+        cond: Condvar::new(),
+    });
+    let q = queue.clone();
+    thread::spawn(move || run_jobs(q, runner));
+    ::http::serve(addr, move |req, stream| handle(&queue, req, stream))
+}
@@ -1,114 +1,416 @@
-extern "C" {
-    fn shp23dtile(name: *const u8, layer: i32, dest: *const u8, height: *const u8) -> bool;
-}
+extern crate libc;
 
-use std::fs;
-use std::fs::File;
+use std::collections::{HashMap, HashSet};
 use std::io;
 use std::io::prelude::*;
+use std::fs;
 use std::path::Path;
+use std::slice;
+
+use fun_c::create_output;
+
+// keep the same as ShpTile in extern.h
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct ShpTile {
+    z: i32,
+    x: i32,
+    y: i32,
+    geometric_error: f64,
+    region: [f64; 6],
+    transform: [f64; 16],
+    uri: [u8; 64],
+}
+
+impl ShpTile {
+    fn uri(&self) -> String {
+        let len = self.uri.iter().position(|&c| c == 0).unwrap_or(self.uri.len());
+        String::from_utf8_lossy(&self.uri[..len]).into()
+    }
+}
+
+extern "C" {
+    fn shp23dtile(
+        name: *const u8,
+        layer: i32,
+        dest: *const u8,
+        height: *const u8,
+        fields: *const u8,
+        implicit: bool,
+        glb: bool,
+        len: *mut i32,
+    ) -> *mut libc::c_void;
+}
+
+// column major 4x4 matrix
+fn matrix_mul(a: &[f64], b: &[f64]) -> Vec<f64> {
+    let mut m = vec![0f64; 16];
+    for c in 0..4 {
+        for r in 0..4 {
+            m[c * 4 + r] = (0..4).map(|k| a[k * 4 + r] * b[c * 4 + k]).sum();
+        }
+    }
+    m
+}
+
+// inverse of the affine transform, rotation part is not strictly orthogonal
+fn matrix_inverse(m: &[f64]) -> Vec<f64> {
+    let a = |r: usize, c: usize| m[c * 4 + r];
+    let det = a(0, 0) * (a(1, 1) * a(2, 2) - a(2, 1) * a(1, 2))
+        - a(0, 1) * (a(1, 0) * a(2, 2) - a(1, 2) * a(2, 0))
+        + a(0, 2) * (a(1, 0) * a(2, 1) - a(1, 1) * a(2, 0));
+    let mut inv = vec![0f64; 16];
+    {
+        let mut set = |r: usize, c: usize, v: f64| inv[c * 4 + r] = v / det;
+        set(0, 0, a(1, 1) * a(2, 2) - a(2, 1) * a(1, 2));
+        set(0, 1, a(0, 2) * a(2, 1) - a(0, 1) * a(2, 2));
+        set(0, 2, a(0, 1) * a(1, 2) - a(0, 2) * a(1, 1));
+        set(1, 0, a(1, 2) * a(2, 0) - a(1, 0) * a(2, 2));
+        set(1, 1, a(0, 0) * a(2, 2) - a(0, 2) * a(2, 0));
+        set(1, 2, a(1, 0) * a(0, 2) - a(0, 0) * a(1, 2));
+        set(2, 0, a(1, 0) * a(2, 1) - a(2, 0) * a(1, 1));
+        set(2, 1, a(2, 0) * a(0, 1) - a(0, 0) * a(2, 1));
+        set(2, 2, a(0, 0) * a(1, 1) - a(1, 0) * a(0, 1));
+    }
+    for r in 0..3 {
+        inv[12 + r] = -(0..3).map(|k| inv[k * 4 + r] * m[12 + k]).sum::<f64>();
+    }
+    inv[15] = 1.0;
+    inv
+}
 
-use serde_json;
-
-fn walk_path(dir: &Path, cb: &mut dyn FnMut(&str)) -> io::Result<()> {
-    if dir.is_dir() {
-        for entry in fs::read_dir(dir)? {
-            let entry = entry?;
-            let path = entry.path();
-            if path.is_dir() {
-                walk_path(&path, cb)?;
-            } else {
-                if let Some(osdir) = path.extension() {
-                    if osdir.to_str() == Some("json") {
-                        cb(&path.to_str().unwrap());
-                    }
+// nest the quadtree tiles under their parent, return the top tiles
+// and the children of every tile by index
+fn link_tiles(tiles: &[ShpTile]) -> (Vec<usize>, Vec<Vec<usize>>) {
+    let mut index = HashMap::new();
+    for (i, t) in tiles.iter().enumerate() {
+        index.insert((t.z, t.x, t.y), i);
+    }
+    let mut roots = vec![];
+    let mut children = vec![vec![]; tiles.len()];
+    for (i, t) in tiles.iter().enumerate() {
+        let parent = if t.z > 0 {
+            index.get(&(t.z - 1, t.x / 2, t.y / 2))
+        } else {
+            None
+        };
+        match parent {
+            Some(&p) => children[p].push(i),
+            None => roots.push(i),
+        }
+    }
+    (roots, children)
+}
+
+fn write_array<W: Write>(w: &mut W, arr: &[f64]) -> io::Result<()> {
+    w.write_all(b"[")?;
+    for (i, v) in arr.iter().enumerate() {
+        if i > 0 {
+            w.write_all(b",")?;
+        }
+        write!(w, "{}", v)?;
+    }
+    w.write_all(b"]")
+}
+
+// stream the tile and its children, the transform of every tile is
+// absolute and turns relative to its parent here
+fn write_tile<W: Write>(
+    w: &mut W,
+    tiles: &[ShpTile],
+    children: &[Vec<usize>],
+    idx: usize,
+    parent_inv: Option<&[f64]>,
+) -> io::Result<()> {
+    let tile = &tiles[idx];
+    w.write_all(b"{\"transform\":")?;
+    match parent_inv {
+        Some(inv) => write_array(w, &matrix_mul(inv, &tile.transform))?,
+        None => write_array(w, &tile.transform)?,
+    }
+    w.write_all(b",\"boundingVolume\":{\"region\":")?;
+    write_array(w, &tile.region)?;
+    write!(
+        w,
+        "}},\"geometricError\":{},\"refine\":\"REPLACE\"",
+        tile.geometric_error
+    )?;
+    let uri = tile.uri();
+    if !uri.is_empty() {
+        write!(w, ",\"content\":{{\"uri\":\"{}\"}}", uri)?;
+    }
+    if !children[idx].is_empty() {
+        let inv = matrix_inverse(&tile.transform);
+        w.write_all(b",\"children\":[")?;
+        for (i, &c) in children[idx].iter().enumerate() {
+            if i > 0 {
+                w.write_all(b",")?;
+            }
+            write_tile(w, tiles, children, c, Some(&inv))?;
+        }
+        w.write_all(b"]")?;
+    }
+    w.write_all(b"}")
+}
+
+fn write_tileset_json(path: &Path, tiles: &[ShpTile], glb: bool) -> io::Result<()> {
+    let (roots, children) = link_tiles(tiles);
+    // minx,miny,maxx,maxy
+    let mut root_region = vec![1.0E+38f64, 1.0E+38, -1.0E+38, -1.0E+38, 1.0E+38, -1.0E+38];
+    for t in tiles {
+        for &x in [0, 1, 4].iter() {
+            root_region[x] = root_region[x].min(t.region[x]);
+        }
+        for &x in [2, 3, 5].iter() {
+            root_region[x] = root_region[x].max(t.region[x]);
+        }
+    }
+    let mut root_error = roots
+        .iter()
+        .map(|&i| tiles[i].geometric_error)
+        .fold(0f64, f64::max);
+    if root_error <= 0.0 {
+        root_error = 200.0;
+    }
+    // the content-less root refines before the real roots, so the coarsest
+    // content shows until the real roots refine in turn
+    let wrapper_error = root_error * 2.0;
+    let mut w = create_output(path)?;
+    // glb content needs 3D Tiles 1.1, its glb are y-up without gltfUpAxis
+    let asset = if glb {
+        "{\"version\":\"1.1\"}"
+    } else {
+        "{\"version\":\"0.0\",\"gltfUpAxis\":\"Z\"}"
+    };
+    write!(w, "{{\"asset\":{},\"geometricError\":{}", asset, wrapper_error)?;
+    w.write_all(b",\"root\":{\"refine\":\"REPLACE\",\"boundingVolume\":{\"region\":")?;
+    write_array(&mut w, &root_region)?;
+    write!(w, "}},\"geometricError\":{},\"children\":[", wrapper_error)?;
+    for (i, &r) in roots.iter().enumerate() {
+        if i > 0 {
+            w.write_all(b",")?;
+        }
+        write_tile(&mut w, tiles, &children, r, None)?;
+    }
+    w.write_all(b"]}}")?;
+    w.finish()
+}
+
+// levels of one subtree file, 1365 tiles and 4096 child subtrees at most
+const SUBTREE_LEVELS: i32 = 6;
+
+// morton order of the quadtree, x takes the lower bit
+fn morton_decode(m: u32) -> (i32, i32) {
+    let (mut x, mut y) = (0, 0);
+    for b in 0..16 {
+        x |= (((m >> (2 * b)) & 1) as i32) << b;
+        y |= (((m >> (2 * b + 1)) & 1) as i32) << b;
+    }
+    (x, y)
+}
+
+struct Bitstream {
+    bits: Vec<u8>,
+    count: usize,
+    ones: usize,
+}
+
+impl Bitstream {
+    fn new(len: usize) -> Bitstream {
+        Bitstream {
+            bits: vec![0; (len + 7) / 8],
+            count: len,
+            ones: 0,
+        }
+    }
+
+    fn set(&mut self, i: usize) {
+        self.bits[i / 8] |= 1 << (i % 8);
+        self.ones += 1;
+    }
+}
+
+// availability of one .subtree, constant if all the bits are the same
+fn write_subtree<W: Write>(w: &mut W, streams: &[Bitstream]) -> io::Result<()> {
+    let mut bin = vec![];
+    let mut views = vec![];
+    let mut availability = vec![];
+    for s in streams {
+        if s.ones == 0 || s.ones == s.count {
+            availability.push(json!({ "constant": if s.ones == 0 { 0 } else { 1 } }));
+            continue;
+        }
+        availability.push(json!({ "bitstream": views.len(), "availableCount": s.ones }));
+        views.push(json!({ "buffer": 0, "byteOffset": bin.len(), "byteLength": s.bits.len() }));
+        bin.extend_from_slice(&s.bits);
+        while bin.len() % 8 != 0 {
+            bin.push(0);
+        }
+    }
+    let mut subtree = json!({
+        "tileAvailability": availability[0],
+        "contentAvailability": [availability[1]],
+        "childSubtreeAvailability": availability[2],
+    });
+    if !bin.is_empty() {
+        subtree["buffers"] = json!([{ "byteLength": bin.len() }]);
+        subtree["bufferViews"] = json!(views);
+    }
+    let mut json_buf = serde_json::to_vec(&subtree)?;
+    while json_buf.len() % 8 != 0 {
+        json_buf.push(b' ');
+    }
+    w.write_all(b"subt")?;
+    w.write_all(&1u32.to_le_bytes())?;
+    w.write_all(&(json_buf.len() as u64).to_le_bytes())?;
+    w.write_all(&(bin.len() as u64).to_le_bytes())?;
+    w.write_all(&json_buf)?;
+    w.write_all(&bin)
+}
+
+/**
+ * 3D Tiles 1.1 implicit tiling, the quadtree is described by
+ * subtrees/{level}/{x}/{y}.subtree instead of the tile list
+ */
+fn write_implicit_tileset(dir: &Path, tiles: &[ShpTile], glb: bool) -> io::Result<()> {
+    let mut available = HashSet::new();
+    let mut content = HashSet::new();
+    let mut levels = 0;
+    for t in tiles {
+        available.insert((t.z, t.x, t.y));
+        if !t.uri().is_empty() {
+            content.insert((t.z, t.x, t.y));
+        }
+        levels = levels.max(t.z + 1);
+    }
+    let root = match tiles.iter().find(|t| t.z == 0) {
+        Some(t) => t,
+        None => return Err(io::Error::new(io::ErrorKind::Other, "no root tile")),
+    };
+    // the same as the explicit root if the root is a leaf
+    let root_error = if root.geometric_error > 0.0 { root.geometric_error } else { 200.0 };
+    let mut region = root.region.to_vec();
+    region[4] = tiles.iter().map(|t| t.region[4]).fold(1.0E+38, f64::min);
+    region[5] = tiles.iter().map(|t| t.region[5]).fold(-1.0E+38, f64::max);
+
+    let mut pending = vec![(0, 0, 0)];
+    while let Some((z0, x0, y0)) = pending.pop() {
+        let tile_count = ((1usize << (2 * SUBTREE_LEVELS)) - 1) / 3;
+        let child_count = 1usize << (2 * SUBTREE_LEVELS);
+        let mut tile_bits = Bitstream::new(tile_count);
+        let mut content_bits = Bitstream::new(tile_count);
+        let mut child_bits = Bitstream::new(child_count);
+        let mut offset = 0;
+        for l in 0..SUBTREE_LEVELS {
+            for m in 0..(1u32 << (2 * l)) {
+                let (x, y) = morton_decode(m);
+                let key = (z0 + l, (x0 << l) + x, (y0 << l) + y);
+                if available.contains(&key) {
+                    tile_bits.set(offset + m as usize);
+                }
+                if content.contains(&key) {
+                    content_bits.set(offset + m as usize);
                 }
             }
+            offset += 1 << (2 * l);
         }
+        for m in 0..child_count as u32 {
+            let (x, y) = morton_decode(m);
+            let key = (
+                z0 + SUBTREE_LEVELS,
+                (x0 << SUBTREE_LEVELS) + x,
+                (y0 << SUBTREE_LEVELS) + y,
+            );
+            if available.contains(&key) {
+                child_bits.set(m as usize);
+                pending.push(key);
+            }
+        }
+        let sub_dir = dir.join("subtrees").join(z0.to_string()).join(x0.to_string());
+        fs::create_dir_all(&sub_dir)?;
+        let mut w = create_output(&sub_dir.join(format!("{}.subtree", y0)))?;
+        write_subtree(&mut w, &[tile_bits, content_bits, child_bits])?;
+        w.finish()?;
     }
-    Ok(())
+
+    let content_uri = if glb {
+        "tile/{level}/{x}/{y}.glb"
+    } else {
+        "tile/{level}/{x}/{y}.b3dm"
+    };
+    let tileset = json!({
+        // the glb are y-up, the b3dm keep their gltfUpAxis
+        "asset": if glb {
+            json!({ "version": "1.1" })
+        } else {
+            json!({ "version": "1.1", "gltfUpAxis": "Z" })
+        },
+        // larger than the root, which refines on its own error
+        "geometricError": root_error * 2.0,
+        "root": {
+            "boundingVolume": { "region": region },
+            "geometricError": root_error,
+            "refine": "REPLACE",
+            "content": { "uri": content_uri },
+            "implicitTiling": {
+                "subdivisionScheme": "QUADTREE",
+                "subtreeLevels": SUBTREE_LEVELS,
+                "availableLevels": levels,
+                "subtrees": { "uri": "subtrees/{level}/{x}/{y}.subtree" }
+            }
+        }
+    });
+    let mut w = create_output(&dir.join("tileset.json"))?;
+    serde_json::to_writer(&mut w, &tileset)?;
+    w.finish()
 }
 
-pub fn shape_batch_convert(from: &str, to: &str, height: &str) -> bool {
-    unsafe {
+pub fn shape_batch_convert(
+    from: &str,
+    to: &str,
+    height: &str,
+    fields: &str,
+    implicit: bool,
+    glb: bool,
+) -> bool {
+    let tiles = unsafe {
         let mut source_vec = String::from(from);
         source_vec.push('\0');
         let mut dest_vec = String::from(to);
         dest_vec.push('\0');
         let mut height_vec = String::from(height);
         height_vec.push('\0');
-        let res = shp23dtile(
+        let mut fields_vec = String::from(fields);
+        fields_vec.push('\0');
+        let mut tile_count = 0i32;
+        let out_ptr = shp23dtile(
             source_vec.as_ptr(),
             0,
             dest_vec.as_ptr(),
             height_vec.as_ptr(),
+            fields_vec.as_ptr(),
+            implicit,
+            glb,
+            &mut tile_count,
         );
-        if !res {
-            return res;
-        }
-        // meger the tile
-        // minx,miny,maxx,maxy
-        let mut tileset_json = json!({
-            "asset":{
-                "version":"0.0",
-                "gltfUpAxis":"Z"
-            },
-            "geometricError":200,
-            "root":{
-                "refine":"REPLACE",
-                "boundingVolume":{
-                    "region":[]
-                },
-                "geometricError":200,
-                "children":[]
-            }
-        });
-        let mut root_region = vec![1.0E+38f64, 1.0E+38, -1.0E+38, -1.0E+38, 1.0E+38, -1.0E+38];
-        let mut json_vec = vec![];
-        walk_path(&Path::new(to).join("tile"), &mut |dir| {
-            let file = File::open(dir).unwrap();
-            let val: serde_json::Value = serde_json::from_reader(file).unwrap();
-            let region = val["root"]["boundingVolume"]["region"].as_array().unwrap();
-            for &x in [0, 1, 4].iter() {
-                let val = region[x].as_f64().unwrap();
-                if val < root_region[x] {
-                    root_region[x] = val;
-                }
-            }
-            for &x in [2, 3, 5].iter() {
-                let val = region[x].as_f64().unwrap();
-                if val > root_region[x] {
-                    root_region[x] = val;
-                }
-            }
-            json_vec.push(val["root"].clone());
-        })
-        .expect("walk_path failed!");
-
-        {
-            let region = tileset_json["root"]["boundingVolume"]["region"]
-                .as_array_mut()
-                .unwrap();
-            for x in root_region {
-                region.push(json!(x));
-            }
+        if out_ptr.is_null() {
+            return false;
         }
-        {
-            let children = tileset_json["root"]["children"].as_array_mut().unwrap();
-            for x in json_vec {
-                children.push(json!(x));
-            }
+        let tiles = slice::from_raw_parts(out_ptr as *const ShpTile, tile_count as usize).to_vec();
+        libc::free(out_ptr);
+        tiles
+    };
+    let path_json = Path::new(to).join("tileset.json");
+    let ret = if implicit {
+        write_implicit_tileset(Path::new(to), &tiles, glb)
+    } else {
+        write_tileset_json(&path_json, &tiles, glb)
+    };
+    match ret {
+        Ok(_) => true,
+        Err(e) => {
+            error!("write {} failed: {}", path_json.display(), e);
+            false
         }
-
-        let dir_dest = Path::new(to);
-        let path_json = dir_dest.join("tileset.json");
-        let mut f = File::create(path_json).unwrap();
-        f.write_all(
-            &serde_json::to_string_pretty(&tileset_json)
-                .unwrap()
-                .into_bytes(),
-        )
-        .unwrap();
-        true
     }
 }
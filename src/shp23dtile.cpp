@@ -21,12 +21,19 @@
 #include <osgUtil/Optimizer>
 #include <osgUtil/SmoothingVisitor>
 
+#include <map>
+#include <mutex>
 #include <vector>
 #include <cmath>
 #include <array>
+#include <cstring>
+#include <algorithm>
 
 using namespace std;
 
+#define SET_MIN(x,v) do{ if (x > v) x = v; }while (0);
+#define SET_MAX(x,v) do{ if (x < v) x = v; }while (0);
+
 using Vextex = vector<array<float, 3>>;
 using Normal = vector<array<float, 3>>;
 using Index = vector<array<int, 3>>;
@@ -135,12 +142,13 @@ public:
         }
     }
 
-    void add(int id, bbox& box) {
+    // every_leaf adds the box to all the leaves it crosses, not only the first
+    void add(int id, bbox& box, bool every_leaf = false) {
         if (!_box.intersect(box)) {
             return;
         }
         if (_box.maxx - _box.minx < metric) {
-            if (!box.isAdd){
+            if (every_leaf || !box.isAdd){
                 geo_items.push_back(id);    
                 box.isAdd = true;
             }
@@ -151,9 +159,9 @@ public:
                 split();
             }
             for (int i = 0; i < 4; i++) {
-                subnode[i]->add(id, box);
+                subnode[i]->add(id, box, every_leaf);
 		//when box is added to a node, stop the loop
-		if (box.isAdd) {
+		if (box.isAdd && !every_leaf) {
 		    break;
 		}
             }
@@ -176,6 +184,22 @@ public:
     }
 };
 
+// dbf field exported to the batch table
+enum { FIELD_INT, FIELD_DOUBLE, FIELD_STRING };
+struct BatchField
+{
+    std::string name;
+    int type;
+    int ogr_index;
+};
+
+// value of one BatchField, number or text by the field type
+struct FieldValue
+{
+    double number;
+    std::string text;
+};
+
 struct Polygon_Mesh
 {
     std::string mesh_name;
@@ -184,6 +208,8 @@ struct Polygon_Mesh
     Normal normal;
     // add some addition 
     float height;
+    // same order as the exported fields, empty for merged features
+    std::vector<FieldValue> attributes;
 };
 
 osg::ref_ptr<osg::Geometry> make_triangle_mesh_auto(Polygon_Mesh& mesh) {
@@ -208,70 +234,65 @@ osg::ref_ptr<osg::Geometry> make_triangle_mesh_auto(Polygon_Mesh& mesh) {
     return geometry;
 }
 
-osg::ref_ptr<osg::Geometry> make_triangle_mesh(Polygon_Mesh& mesh) {
-    osg::ref_ptr<osg::Vec3Array> va = new osg::Vec3Array(mesh.vertex.size());
-    for (int i = 0; i < mesh.vertex.size(); i++) {
-        (*va)[i].set(mesh.vertex[i][0], mesh.vertex[i][1], mesh.vertex[i][2]);
-    }
-    osg::ref_ptr<osg::Vec3Array> vn = new osg::Vec3Array(mesh.normal.size());
-    for (int i = 0; i < mesh.normal.size(); i++) {
-        (*vn)[i].set(mesh.normal[i][0], mesh.normal[i][1], mesh.normal[i][2]);
-    }
-    osg::ref_ptr<osg::Geometry> geometry = new osg::Geometry;
-    geometry->setVertexArray(va);
-    geometry->setNormalArray(vn);
-    osg::DrawElementsUShort* _set = new osg::DrawElementsUShort(osg::DrawArrays::TRIANGLES);
-    for (int i = 0; i < mesh.index.size(); i++) {
-        _set->addElement(mesh.index[i][0]);
-        _set->addElement(mesh.index[i][1]);
-        _set->addElement(mesh.index[i][2]);
-    }
-    geometry->addPrimitiveSet(_set);
-    //osgUtil::SmoothingVisitor::smooth(*geometry);
-    return geometry;
-}
-
 void calc_normal(int baseCnt, int ptNum, Polygon_Mesh &mesh)
 {
     // normal stand for one triangle
     for (int i = 0; i < ptNum; i+=2) {
-        osg::Vec2 *nor1 = 0;
-        nor1 = new osg::Vec2(mesh.vertex[baseCnt + 2 * (i + 1)][0], mesh.vertex[baseCnt + 2 * (i + 1)][1]);
-        *nor1 = *nor1 - osg::Vec2(mesh.vertex[baseCnt + 2 * i][0], mesh.vertex[baseCnt + 2 * i][1]);
-        osg::Vec3 nor3 = osg::Vec3(-nor1->y(), nor1->x(), 0);
-        nor3.normalize();
-        delete nor1;
-        mesh.normal.push_back({ nor3.x(), nor3.y(), nor3.z() });
-        mesh.normal.push_back({ nor3.x(), nor3.y(), nor3.z() });
-        mesh.normal.push_back({ nor3.x(), nor3.y(), nor3.z() });
-        mesh.normal.push_back({ nor3.x(), nor3.y(), nor3.z() });
+        auto& p0 = mesh.vertex[baseCnt + 2 * i];
+        auto& p1 = mesh.vertex[baseCnt + 2 * (i + 1)];
+        float nx = -(p1[1] - p0[1]);
+        float ny = p1[0] - p0[0];
+        float len = std::sqrt(nx * nx + ny * ny);
+        if (len > 0) {
+            nx /= len;
+            ny /= len;
+        }
+        mesh.normal.push_back({ nx, ny, 0 });
+        mesh.normal.push_back({ nx, ny, 0 });
+        mesh.normal.push_back({ nx, ny, 0 });
+        mesh.normal.push_back({ nx, ny, 0 });
     }
 }
 
-#ifdef _WIN32
+struct Footprint
+{
+    // lon/lat in degree with the bottom z, the first ring is exterior
+    std::vector<std::vector<std::array<double, 3>>> rings;
+    std::string name;
+    float height;
+    std::vector<FieldValue> attributes;
+};
+
+using Earcut = mapbox::detail::Earcut<int>;
+
+// earcut is reused across polygons to keep its node pool
 Polygon_Mesh
-convert_polygon(OGRPolygon* polyon, double center_x, double center_y, double height)
+convert_polygon(Footprint& footprint, double center_x, double center_y, Earcut& earcut)
 {
-    //double bottom = 0.0;
     Polygon_Mesh mesh;
-    OGRLinearRing* pRing = polyon->getExteriorRing();
-    int ptNum = pRing->getNumPoints();
+    if (footprint.rings.empty()) {
+        return mesh;
+    }
+    double height = footprint.height;
+    auto local_point = [&](std::array<double, 3>& pt) -> std::array<float, 3> {
+        float point_x = (float)longti_to_meter(degree2rad(pt[0] - center_x), degree2rad(center_y));
+        float point_y = (float)lati_to_meter(degree2rad(pt[1] - center_y));
+        return { point_x, point_y, (float)pt[2] };
+    };
+    auto& outer = footprint.rings[0];
+    int ptNum = outer.size();
     if (ptNum < 4) {
         return mesh;
     }
     int pt_count = 0;
     for (int i = 0; i < ptNum; i++) {
-        OGRPoint pt;
-        pRing->getPoint(i, &pt);
-		double bottom = pt.getZ();
-        float point_x = (float)longti_to_meter(degree2rad(pt.getX() - center_x), degree2rad(center_y));
-        float point_y = (float)lati_to_meter(degree2rad(pt.getY() - center_y));
-        mesh.vertex.push_back({ point_x , point_y, (float)bottom });
-        mesh.vertex.push_back({ point_x , point_y, (float)height });
+        auto pt = local_point(outer[i]);
+        mesh.vertex.push_back({ pt[0] , pt[1], pt[2] });
+        mesh.vertex.push_back({ pt[0] , pt[1], (float)height });
         // double vertex
         if (i != 0 && i != ptNum - 1) {
-            mesh.vertex.push_back({ point_x , point_y, (float)bottom });
-            mesh.vertex.push_back({ point_x , point_y, (float)height });
+            mesh.vertex.push_back({ pt[0] , pt[1], pt[2] });
+            mesh.vertex.push_back({ pt[0] , pt[1], (float)height });
         }
     }
     int vertex_num = mesh.vertex.size() / 2;
@@ -284,25 +305,21 @@ convert_polygon(OGRPolygon* polyon, double center_x, double center_y, double hei
     calc_normal(0, vertex_num, mesh);
     pt_count += 2 * vertex_num;
 
-    int inner_count = polyon->getNumInteriorRings();
+    int inner_count = footprint.rings.size() - 1;
     for (int j = 0; j < inner_count; j++) {
-        OGRLinearRing* pRing = polyon->getInteriorRing(j);
-        int ptNum = pRing->getNumPoints();
+        auto& ring = footprint.rings[j + 1];
+        int ptNum = ring.size();
         if (ptNum < 4) {
             continue;
         }
         for (int i = 0; i < ptNum; i++) {
-            OGRPoint pt;
-            pRing->getPoint(i, &pt);
-			double bottom = pt.getZ();
-            float point_x = (float)longti_to_meter(degree2rad(pt.getX() - center_x), degree2rad(center_y));
-            float point_y = (float)lati_to_meter(degree2rad(pt.getY() - center_y));
-            mesh.vertex.push_back({ point_x , point_y, (float)bottom });
-            mesh.vertex.push_back({ point_x , point_y, (float)height });
+            auto pt = local_point(ring[i]);
+            mesh.vertex.push_back({ pt[0] , pt[1], pt[2] });
+            mesh.vertex.push_back({ pt[0] , pt[1], (float)height });
             // double vertex
             if (i != 0 && i != ptNum - 1) {
-                mesh.vertex.push_back({ point_x , point_y, (float)bottom });
-                mesh.vertex.push_back({ point_x , point_y, (float)height });
+                mesh.vertex.push_back({ pt[0] , pt[1], pt[2] });
+                mesh.vertex.push_back({ pt[0] , pt[1], (float)height });
             }
         }
         vertex_num = mesh.vertex.size() / 2 - pt_count;
@@ -319,44 +336,30 @@ convert_polygon(OGRPolygon* polyon, double center_x, double center_y, double hei
     {
         using Point = std::array<double, 2>;
         std::vector<std::vector<Point>> polygon(1);
+        for (auto& ring_pt : outer)
         {
-            OGRLinearRing* pRing = polyon->getExteriorRing();
-            int ptNum = pRing->getNumPoints();
-            for (int i = 0; i < ptNum; i++)
-            {
-                OGRPoint pt;
-                pRing->getPoint(i, &pt);
-				double bottom = pt.getZ();
-                float point_x = (float)longti_to_meter(degree2rad(pt.getX() - center_x), degree2rad(center_y));
-                float point_y = (float)lati_to_meter(degree2rad(pt.getY() - center_y));
-                polygon[0].push_back({ point_x, point_y });
-                mesh.vertex.push_back({ point_x , point_y, (float)bottom });
-                mesh.vertex.push_back({ point_x , point_y, (float)height });
-                mesh.normal.push_back({ 0,0,-1 });
-                mesh.normal.push_back({ 0,0,1 });
-            }
+            auto pt = local_point(ring_pt);
+            polygon[0].push_back({ pt[0], pt[1] });
+            mesh.vertex.push_back({ pt[0] , pt[1], pt[2] });
+            mesh.vertex.push_back({ pt[0] , pt[1], (float)height });
+            mesh.normal.push_back({ 0,0,-1 });
+            mesh.normal.push_back({ 0,0,1 });
         }
-        int inner_count = polyon->getNumInteriorRings();
         for (int j = 0; j < inner_count; j++)
         {
             polygon.resize(polygon.size() + 1);
-            OGRLinearRing* pRing = polyon->getInteriorRing(j);
-            int ptNum = pRing->getNumPoints();
-            for (int i = 0; i < ptNum; i++)
+            for (auto& ring_pt : footprint.rings[j + 1])
             {
-                OGRPoint pt;
-                pRing->getPoint(i, &pt);
-				double bottom = pt.getZ();
-                float point_x = (float)longti_to_meter(degree2rad(pt.getX() - center_x), degree2rad(center_y));
-                float point_y = (float)lati_to_meter(degree2rad(pt.getY() - center_y));
-                polygon[j].push_back({ point_x, point_y });
-                mesh.vertex.push_back({ point_x , point_y, (float)bottom });
-                mesh.vertex.push_back({ point_x , point_y, (float)height });
+                auto pt = local_point(ring_pt);
+                polygon[j + 1].push_back({ pt[0], pt[1] });
+                mesh.vertex.push_back({ pt[0] , pt[1], pt[2] });
+                mesh.vertex.push_back({ pt[0] , pt[1], (float)height });
                 mesh.normal.push_back({ 0,0,-1 });
                 mesh.normal.push_back({ 0,0,1 });
             }
         }
-        std::vector<int> indices = mapbox::earcut<int>(polygon);
+        earcut(polygon);
+        std::vector<int>& indices = earcut.indices;
         for (int idx = 0; idx < indices.size(); idx += 3) {
             mesh.index.push_back({ 
                 pt_count + 2 * indices[idx], 
@@ -370,27 +373,581 @@ convert_polygon(OGRPolygon* polyon, double center_x, double center_y, double hei
                 pt_count + 2 * indices[idx + 2] + 1});
         }
     }
+    mesh.mesh_name = footprint.name;
+    mesh.height = footprint.height;
+    mesh.attributes = footprint.attributes;
     return mesh;
 }
+
+#ifdef _WIN32
+Footprint
+read_polygon(OGRPolygon* polyon, std::string name, double height)
+{
+    Footprint footprint;
+    footprint.name = name;
+    footprint.height = height;
+    auto read_ring = [&](OGRLinearRing* pRing) {
+        std::vector<std::array<double, 3>> ring;
+        int ptNum = pRing->getNumPoints();
+        for (int i = 0; i < ptNum; i++) {
+            OGRPoint pt;
+            pRing->getPoint(i, &pt);
+            ring.push_back({ pt.getX(), pt.getY(), pt.getZ() });
+        }
+        footprint.rings.push_back(std::move(ring));
+    };
+    read_ring(polyon->getExteriorRing());
+    int inner_count = polyon->getNumInteriorRings();
+    for (int j = 0; j < inner_count; j++) {
+        read_ring(polyon->getInteriorRing(j));
+    }
+    return footprint;
+}
+#endif
+
+/////////////////////////
+// generalized content of the parent tiles
+
+using Point2d = std::array<double, 2>;
+
+double seg_distance(Point2d& p, Point2d& a, Point2d& b)
+{
+    double dx = b[0] - a[0], dy = b[1] - a[1];
+    double len2 = dx * dx + dy * dy;
+    double t = 0;
+    if (len2 > 0) {
+        t = ((p[0] - a[0]) * dx + (p[1] - a[1]) * dy) / len2;
+        t = std::max(0.0, std::min(1.0, t));
+    }
+    double x = a[0] + t * dx - p[0];
+    double y = a[1] + t * dy - p[1];
+    return std::sqrt(x * x + y * y);
+}
+
+// Douglas-Peucker, the ring is closed so the first and last point stay
+std::vector<int> simplify_ring(std::vector<Point2d>& ring, double tolerance)
+{
+    int n = ring.size();
+    std::vector<char> keep(n, 0);
+    keep[0] = keep[n - 1] = 1;
+    std::vector<std::pair<int, int>> stack = { { 0, n - 1 } };
+    while (!stack.empty()) {
+        auto seg = stack.back();
+        stack.pop_back();
+        double max_dis = 0;
+        int max_idx = -1;
+        for (int i = seg.first + 1; i < seg.second; i++) {
+            double dis = seg_distance(ring[i], ring[seg.first], ring[seg.second]);
+            if (dis > max_dis) {
+                max_dis = dis;
+                max_idx = i;
+            }
+        }
+        if (max_idx > 0 && max_dis > tolerance) {
+            keep[max_idx] = 1;
+            stack.push_back({ seg.first, max_idx });
+            stack.push_back({ max_idx, seg.second });
+        }
+    }
+    std::vector<int> index;
+    for (int i = 0; i < n; i++) {
+        if (keep[i]) index.push_back(i);
+    }
+    return index;
+}
+
+// monotone chain, return a closed clockwise ring as the shapefile does
+std::vector<Point2d> convex_hull(std::vector<Point2d> pts)
+{
+    std::sort(pts.begin(), pts.end());
+    pts.erase(std::unique(pts.begin(), pts.end()), pts.end());
+    if (pts.size() < 3) {
+        return {};
+    }
+    auto cross = [](Point2d& o, Point2d& a, Point2d& b) {
+        return (a[0] - o[0]) * (b[1] - o[1]) - (a[1] - o[1]) * (b[0] - o[0]);
+    };
+    std::vector<Point2d> hull(2 * pts.size());
+    int k = 0;
+    for (int i = 0; i < pts.size(); i++) {
+        while (k >= 2 && cross(hull[k - 2], hull[k - 1], pts[i]) <= 0) k--;
+        hull[k++] = pts[i];
+    }
+    for (int i = pts.size() - 2, t = k + 1; i >= 0; i--) {
+        while (k >= t && cross(hull[k - 2], hull[k - 1], pts[i]) <= 0) k--;
+        hull[k++] = pts[i];
+    }
+    hull.resize(k);
+    std::reverse(hull.begin(), hull.end());
+    return hull;
+}
+
+double ring_area(std::vector<Point2d>& ring)
+{
+    double area = 0;
+    for (int i = 0; i + 1 < ring.size(); i++) {
+        area += ring[i][0] * ring[i + 1][1] - ring[i + 1][0] * ring[i][1];
+    }
+    return std::abs(area) / 2;
+}
+
+/**
+ * generalize the footprints of a parent tile:
+ * rings are simplified by Douglas-Peucker with tolerance,
+ * features smaller than 8 * tolerance are merged into the
+ * convex hull of their neighbours in a 8 * tolerance grid,
+ * blocks still smaller than 2 * tolerance are dropped.
+*/
+std::vector<Footprint>
+generalize_footprints(std::vector<Footprint>& footprints,
+    double center_x, double center_y, double tolerance)
+{
+    double rad_y = degree2rad(center_y);
+    auto to_local = [&](std::array<double, 3>& pt) -> Point2d {
+        return {
+            longti_to_meter(degree2rad(pt[0] - center_x), rad_y),
+            lati_to_meter(degree2rad(pt[1] - center_y))
+        };
+    };
+    auto to_lonlat = [&](Point2d& pt, double z) -> std::array<double, 3> {
+        return {
+            center_x + meter_to_longti(pt[0], rad_y) * 180.0 / std::acos(-1),
+            center_y + meter_to_lati(pt[1]) * 180.0 / std::acos(-1),
+            z
+        };
+    };
+    double drop_size = tolerance * 2;
+    double merge_size = tolerance * 8;
+
+    struct Cluster {
+        std::vector<Point2d> points;
+        double bottom = 1e38;
+        double area = 0;
+        double height = 0;
+        int count = 0;
+        std::string name;
+    };
+    std::map<std::pair<long long, long long>, Cluster> clusters;
+    std::vector<Footprint> result;
+    for (auto& fp : footprints) {
+        if (fp.rings.empty() || fp.rings[0].size() < 4) {
+            continue;
+        }
+        Footprint simple;
+        simple.name = fp.name;
+        simple.height = fp.height;
+        simple.attributes = fp.attributes;
+        double minx = 1e38, miny = 1e38, maxx = -1e38, maxy = -1e38;
+        double bottom = 1e38;
+        for (int r = 0; r < fp.rings.size(); r++) {
+            std::vector<Point2d> ring;
+            for (auto& pt : fp.rings[r]) {
+                ring.push_back(to_local(pt));
+                SET_MIN(bottom, pt[2]);
+            }
+            if (r == 0) {
+                for (auto& pt : ring) {
+                    SET_MIN(minx, pt[0]); SET_MAX(maxx, pt[0]);
+                    SET_MIN(miny, pt[1]); SET_MAX(maxy, pt[1]);
+                }
+            }
+            std::vector<int> index = simplify_ring(ring, tolerance);
+            // collapsed ring
+            if (index.size() < 4) {
+                continue;
+            }
+            std::vector<std::array<double, 3>> ring_ll;
+            for (int i : index) {
+                ring_ll.push_back(fp.rings[r][i]);
+            }
+            if (r > 0 && simple.rings.empty()) {
+                break;
+            }
+            simple.rings.push_back(std::move(ring_ll));
+        }
+        double size = std::max(maxx - minx, maxy - miny);
+        if (size < merge_size || simple.rings.empty()) {
+            double cx = (minx + maxx) / 2, cy = (miny + maxy) / 2;
+            auto& cluster = clusters[{
+                (long long)std::floor(cx / merge_size),
+                (long long)std::floor(cy / merge_size) }];
+            std::vector<Point2d> pts;
+            for (auto& pt : fp.rings[0]) pts.push_back(to_local(pt));
+            double area = ring_area(pts);
+            cluster.points.insert(cluster.points.end(), pts.begin(), pts.end());
+            SET_MIN(cluster.bottom, bottom);
+            cluster.area += area;
+            cluster.height += fp.height * area;
+            if (cluster.count++ == 0) {
+                cluster.name = fp.name;
+            }
+            continue;
+        }
+        result.push_back(std::move(simple));
+    }
+    for (auto& it : clusters) {
+        Cluster& cluster = it.second;
+        std::vector<Point2d> hull = convex_hull(cluster.points);
+        if (hull.size() < 4) {
+            continue;
+        }
+        double minx = 1e38, miny = 1e38, maxx = -1e38, maxy = -1e38;
+        for (auto& pt : hull) {
+            SET_MIN(minx, pt[0]); SET_MAX(maxx, pt[0]);
+            SET_MIN(miny, pt[1]); SET_MAX(maxy, pt[1]);
+        }
+        if (std::max(maxx - minx, maxy - miny) < drop_size) {
+            continue;
+        }
+        std::vector<int> index = simplify_ring(hull, tolerance);
+        if (index.size() < 4) {
+            continue;
+        }
+        Footprint merged;
+        merged.name = cluster.name;
+        if (cluster.count > 1 && cluster.name.compare(0, 7, "merged_") != 0) {
+            merged.name = "merged_" + cluster.name;
+        }
+        merged.height = cluster.area > 0 ? cluster.height / cluster.area : 0;
+        std::vector<std::array<double, 3>> ring;
+        for (int i : index) {
+            ring.push_back(to_lonlat(hull[i], cluster.bottom));
+        }
+        merged.rings.push_back(std::move(ring));
+        result.push_back(std::move(merged));
+    }
+    return result;
+}
+
+std::string make_polymesh(std::vector<Polygon_Mesh>& meshes,
+    const std::vector<BatchField>* metadata = NULL, double* rtc_center = NULL, bool y_up = false);
+std::string make_b3dm(std::vector<Polygon_Mesh>& meshes, const std::vector<BatchField>& fields, double* rtc_center);
+
+// turn the mesh from the tile enu frame to ecef axes, relative to the tile center
+void mesh_to_ecef(Polygon_Mesh& mesh, double* matrix)
+{
+    auto rotate = [&](std::array<float, 3>& v) {
+        double x = v[0], y = v[1], z = v[2];
+        for (int k = 0; k < 3; k++) {
+            v[k] = (float)(matrix[k] * x + matrix[4 + k] * y + matrix[8 + k] * z);
+        }
+    };
+    for (auto& v : mesh.vertex) rotate(v);
+    for (auto& n : mesh.normal) rotate(n);
+}
+
+// how the tile content is written
+struct ShpTileOptions
+{
+    const char* dest;
+    std::vector<BatchField> fields;
+    // 3D Tiles 1.1 implicit tiling
+    bool implicit;
+    // clip the leaf features to the quadtree cell, the implicit tiles
+    // keep the cell box and a feature is in every leaf it crosses
+    bool clip;
+    // .glb content instead of .b3dm
+    bool glb;
+};
+
+// write content of one quadtree node and keep its tile, no content if meshes is empty
+// implicit tiles keep the quadtree box and share the root frame, so the
+// content carries its own RTC_CENTER instead of a tile transform
+void write_node_tile(node* _node, std::vector<Polygon_Mesh>& meshes,
+    double max_height, double geometric_error,
+    const ShpTileOptions& options, std::vector<ShpTile>& tiles)
+{
+    bool implicit = options.implicit;
+    ShpTile tile;
+    tile.z = _node->_z;
+    tile.x = _node->_x;
+    tile.y = _node->_y;
+    tile.geometric_error = geometric_error;
+    tile.uri[0] = 0;
+    double center_x = ( _node->_box.minx + _node->_box.maxx ) / 2;
+    double center_y = ( _node->_box.miny + _node->_box.maxy ) / 2;
+    double box_width = ( _node->_box.maxx - _node->_box.minx );
+    double box_height = ( _node->_box.maxy - _node->_box.miny );
+    double radian_x = degree2rad(center_x);
+    double radian_y = degree2rad(center_y);
+    double scale = implicit ? 1.0 : 1.05;
+    tile_region(radian_x, radian_y, 
+        longti_to_meter(degree2rad(box_width) * scale, radian_y),
+        lati_to_meter(degree2rad(box_height)  * scale),
+        0 , max_height, tile.region, tile.transform);
+    if (!meshes.empty()) {
+        const char* ext = options.glb ? "glb" : "b3dm";
+        char tile_file[512];
+        sprintf(tile_file, "%s\\tile\\%d\\%d", options.dest, _node->_z, _node->_x);
+        mkdirs(tile_file);
+        sprintf(tile_file, "%s\\tile\\%d\\%d\\%d.%s", options.dest, _node->_z, _node->_x, _node->_y, ext);
+        double* rtc_center = NULL;
+        if (implicit) {
+            for (auto& mesh : meshes) {
+                mesh_to_ecef(mesh, tile.transform);
+            }
+            rtc_center = tile.transform + 12;
+        }
+        std::string tile_buf;
+        if (options.glb) {
+            tile_buf = make_polymesh(meshes, &options.fields, rtc_center, true);
+        }
+        else {
+            tile_buf = make_b3dm(meshes, options.fields, rtc_center);
+        }
+        write_file(tile_file, tile_buf.data(), tile_buf.size());
+        sprintf(tile.uri, "./tile/%d/%d/%d.%s", _node->_z, _node->_x, _node->_y, ext);
+    }
+    tiles.push_back(tile);
+}
+
+#ifdef _WIN32
+struct ShpBuildState
+{
+    OGRLayer* layer;
+    int field_index;
+    ShpTileOptions options;
+    std::vector<ShpTile> tiles;
+};
+
+// the polygons of a feature geometry, a clipped one may be a collection
+void read_polygons(OGRGeometry* geometry, const std::string& name, double height,
+    const std::vector<FieldValue>& attributes, std::vector<Footprint>& footprints)
+{
+    OGRwkbGeometryType type = wkbFlatten(geometry->getGeometryType());
+    if (type == wkbPolygon) {
+        footprints.push_back(read_polygon((OGRPolygon*)geometry, name, height));
+        footprints.back().attributes = attributes;
+    }
+    else if (type == wkbMultiPolygon || type == wkbGeometryCollection) {
+        OGRGeometryCollection* collection = (OGRGeometryCollection*)geometry;
+        for (int j = 0; j < collection->getNumGeometries(); j++) {
+            read_polygons(collection->getGeometryRef(j), name, height, attributes, footprints);
+        }
+    }
+}
+
+/**
+ * convert the node and its sub nodes depth first,
+ * leaf keeps the full detail, parent is generalized from
+ * the footprints its children returned.
+*/
+bool make_node_tile(node* _node, ShpBuildState* shpState,
+    std::vector<Footprint>& footprints, double& max_height)
+{
+    OGRLayer* poLayer = shpState->layer;
+    max_height = 0;
+    if (_node->subnode[0] == 0) {
+        if (_node->get_ids().empty()) {
+            return false;
+        }
+        // fix the box, implicit tiles must keep the quadtree box
+        if (!shpState->options.implicit) {
+            OGREnvelope node_box;
+            for (auto id : _node->get_ids()) {
+                OGRFeature *poFeature = poLayer->GetFeature(id);
+                OGRGeometry* poGeometry = poFeature->GetGeometryRef();
+                OGREnvelope geo_box;
+                poGeometry->getEnvelope(&geo_box);
+                if ( !node_box.IsInit() ) {
+                    node_box = geo_box;
+                }
+                else {
+                    node_box.Merge(geo_box);
+                }
+                OGRFeature::DestroyFeature(poFeature);
+            }
+            _node->_box.minx = node_box.MinX;
+            _node->_box.maxx = node_box.MaxX;
+            _node->_box.miny = node_box.MinY;
+            _node->_box.maxy = node_box.MaxY;
+        }
+        OGRPolygon cell;
+        if (shpState->options.clip) {
+            OGRLinearRing ring;
+            ring.addPoint(_node->_box.minx, _node->_box.miny);
+            ring.addPoint(_node->_box.maxx, _node->_box.miny);
+            ring.addPoint(_node->_box.maxx, _node->_box.maxy);
+            ring.addPoint(_node->_box.minx, _node->_box.maxy);
+            ring.closeRings();
+            cell.addRing(&ring);
+        }
+        for (auto id : _node->get_ids()) {
+            OGRFeature *poFeature = poLayer->GetFeature(id);
+            OGRGeometry *poGeometry;
+            poGeometry = poFeature->GetGeometryRef();
+            double height = 50.0;
+            if( shpState->field_index >= 0 ) {
+                height = poFeature->GetFieldAsDouble(shpState->field_index);
+            }
+            if (height > max_height) {
+                max_height = height;
+            }
+            std::string mesh_name = "mesh_" + std::to_string(id);
+            std::vector<FieldValue> attributes;
+            for (auto& field : shpState->options.fields) {
+                FieldValue val = { 0 };
+                if (field.type == FIELD_STRING) {
+                    val.text = poFeature->GetFieldAsString(field.ogr_index);
+                }
+                else if (field.type == FIELD_INT) {
+                    val.number = poFeature->GetFieldAsInteger(field.ogr_index);
+                }
+                else {
+                    val.number = poFeature->GetFieldAsDouble(field.ogr_index);
+                }
+                attributes.push_back(std::move(val));
+            }
+            OGRGeometry* clipped = NULL;
+            if (shpState->options.clip) {
+                clipped = poGeometry->Intersection(&cell);
+                poGeometry = clipped;
+            }
+            if (poGeometry && !poGeometry->IsEmpty()) {
+                read_polygons(poGeometry, mesh_name, height, attributes, footprints);
+            }
+            OGRGeometryFactory::destroyGeometry(clipped);
+            OGRFeature::DestroyFeature(poFeature);
+        }
+        if (footprints.empty()) {
+            return false;
+        }
+        double center_x = ( _node->_box.minx + _node->_box.maxx ) / 2;
+        double center_y = ( _node->_box.miny + _node->_box.maxy ) / 2;
+        Earcut earcut;
+        std::vector<Polygon_Mesh> v_meshes;
+        v_meshes.reserve(footprints.size());
+        for (auto& footprint : footprints) {
+            v_meshes.push_back(convert_polygon(footprint, center_x, center_y, earcut));
+        }
+        write_node_tile(_node, v_meshes, max_height, 0, shpState->options, shpState->tiles);
+        return true;
+    }
+
+    bool has_child = false;
+    bbox box(1e38, -1e38, 1e38, -1e38);
+    for (int i = 0; i < 4; i++) {
+        std::vector<Footprint> sub_footprints;
+        double sub_height = 0;
+        if (!make_node_tile(_node->subnode[i], shpState, sub_footprints, sub_height)) {
+            continue;
+        }
+        bbox& sub_box = _node->subnode[i]->_box;
+        SET_MIN(box.minx, sub_box.minx);
+        SET_MAX(box.maxx, sub_box.maxx);
+        SET_MIN(box.miny, sub_box.miny);
+        SET_MAX(box.maxy, sub_box.maxy);
+        SET_MAX(max_height, sub_height);
+        footprints.insert(footprints.end(),
+            std::make_move_iterator(sub_footprints.begin()),
+            std::make_move_iterator(sub_footprints.end()));
+        has_child = true;
+    }
+    if (!has_child) {
+        return false;
+    }
+    if (!shpState->options.implicit) {
+        _node->_box = box;
+    }
+    box = _node->_box;
+    double center_x = ( box.minx + box.maxx ) / 2;
+    double center_y = ( box.miny + box.maxy ) / 2;
+    // tolerance grows with the node, parent of leaf ~ 2km --> 4m
+    double node_width = std::max(
+        longti_to_meter(degree2rad(box.maxx - box.minx), degree2rad(center_y)),
+        lati_to_meter(degree2rad(box.maxy - box.miny)));
+    double tolerance = node_width / 512;
+    footprints = generalize_footprints(footprints, center_x, center_y, tolerance);
+    Earcut earcut;
+    std::vector<Polygon_Mesh> v_meshes;
+    v_meshes.reserve(footprints.size());
+    for (auto& footprint : footprints) {
+        v_meshes.push_back(convert_polygon(footprint, center_x, center_y, earcut));
+    }
+    // merged block stands for the 8 * tolerance grid
+    write_node_tile(_node, v_meshes, max_height, tolerance * 8, shpState->options, shpState->tiles);
+    return true;
+}
 #endif
 
-std::string make_polymesh(std::vector<Polygon_Mesh>& meshes);
-std::string make_b3dm(std::vector<Polygon_Mesh>& meshes, bool);
-//
-extern "C" bool
+#ifdef _WIN32
+// fields: "*" for all, or names split by ','
+std::vector<BatchField> read_batch_fields(OGRLayer* poLayer, const char* fields)
+{
+    std::vector<BatchField> result;
+    if (!fields || !fields[0]) {
+        return result;
+    }
+    OGRFeatureDefn* poDefn = poLayer->GetLayerDefn();
+    std::vector<int> index;
+    if (std::string(fields) == "*") {
+        for (int i = 0; i < poDefn->GetFieldCount(); i++) {
+            index.push_back(i);
+        }
+    }
+    else {
+        std::string names = fields;
+        size_t start = 0;
+        while (start <= names.size()) {
+            size_t end = names.find(',', start);
+            if (end == std::string::npos) end = names.size();
+            std::string name = names.substr(start, end - start);
+            start = end + 1;
+            if (name.empty()) continue;
+            int i = poDefn->GetFieldIndex(name.c_str());
+            if (i < 0) {
+                LOG_E("can`t found field [%s]", name.c_str());
+                continue;
+            }
+            index.push_back(i);
+        }
+    }
+    for (int i : index) {
+        OGRFieldDefn* poField = poDefn->GetFieldDefn(i);
+        BatchField field;
+        field.name = poField->GetNameRef();
+        field.ogr_index = i;
+        switch (poField->GetType()) {
+        case OFTInteger:
+            field.type = FIELD_INT;
+            break;
+        case OFTInteger64:
+        case OFTReal:
+            field.type = FIELD_DOUBLE;
+            break;
+        default:
+            field.type = FIELD_STRING;
+            break;
+        }
+        result.push_back(field);
+    }
+    return result;
+}
+#endif
+
+/**
+ * return the tiles as malloc ShpTile array, len is the tile count
+ * fields are the dbf fields written to the batch table, "*" for all
+ * implicit keeps the quadtree boxes for 3D Tiles implicit tiling
+ * glb writes .glb content with EXT_mesh_features instead of .b3dm
+*/
+extern "C" void*
 shp23dtile(const char* filename, int layer_id,
-            const char* dest, const char* height)
+            const char* dest, const char* height,
+            const char* fields, bool implicit, bool glb, int* len)
 {
 #ifdef _WIN32
     if (!filename || layer_id < 0 || layer_id > 10000 || !dest) {
         LOG_E("make shp23dtile [%s] failed", filename);
-        return false;
+        return NULL;
     }
     std::string height_field = "";
     if( height ) {
         height_field = height;
     }
-    GDALAllRegister();
+    // once per process, --serve converts many shapefiles
+    static std::once_flag gdal_registered;
+    std::call_once(gdal_registered, GDALAllRegister);
     GDALDataset       *poDS;
     poDS = (GDALDataset*)GDALOpenEx(
         filename, GDAL_OF_VECTOR,
@@ -398,14 +955,14 @@ shp23dtile(const char* filename, int layer_id,
     if (poDS == NULL)
     {
         LOG_E("open shapefile [%s] failed", filename);
-        return false;
+        return NULL;
     }
     OGRLayer  *poLayer;
     poLayer = poDS->GetLayer(layer_id);
     if (!poLayer) {
         GDALClose(poDS);
         LOG_E("open layer [%s]:[%d] failed", filename, layer_id);
-        return false;
+        return NULL;
     }
     OGRwkbGeometryType _t = poLayer->GetGeomType();
     if (_t != wkbPolygon && _t != wkbMultiPolygon &&
@@ -413,20 +970,25 @@ shp23dtile(const char* filename, int layer_id,
     {
         GDALClose(poDS);
         LOG_E("only support polyon now");
-        return false;
+        return NULL;
     }
 
     OGREnvelope envelop;
     OGRErr err = poLayer->GetExtent(&envelop);
     if (err != OGRERR_NONE) {
         LOG_E("no extent found in shapefile");
-        return false;
+        return NULL;
     }
     if (envelop.MaxX > 180 || envelop.MinX < -180 || envelop.MaxY > 90 || envelop.MinY < -90) {
         LOG_E("only support WGS-84 now");
-        return false;
+        return NULL;
     }
 
+    // the implicit tiles keep the quadtree boxes, the leaves clip to them
+    bool clip = implicit && OGRGeometryFactory::haveGEOS();
+    if (implicit && !clip) {
+        LOG_E("gdal built without GEOS, features may overflow their implicit tiles");
+    }
     bbox bound(envelop.MinX, envelop.MaxX, envelop.MinY, envelop.MaxY);
     node root(bound);
     OGRFeature *poFeature;
@@ -443,13 +1005,9 @@ shp23dtile(const char* filename, int layer_id,
         poGeometry->getEnvelope(&envelop);
         bbox bound(envelop.MinX, envelop.MaxX, envelop.MinY, envelop.MaxY);
         unsigned long long id = poFeature->GetFID();
-        root.add(id, bound);
+        root.add(id, bound, clip);
         OGRFeature::DestroyFeature(poFeature);
     }
-    // iter all node and convert to obj 
-    std::vector<void*> items_array;
-    root.get_all(items_array);
-    //
     int field_index = -1;
     
     if (!height_field.empty()) {
@@ -458,95 +1016,30 @@ shp23dtile(const char* filename, int layer_id,
             LOG_E("can`t found field [%s] in [%s]", height_field.c_str(), filename);
         }
     }
-    for (auto item : items_array) {
-        node* _node = (node*)item;
-        char b3dm_file[512];
-        sprintf(b3dm_file, "%s\\tile\\%d\\%d", dest, _node->_z, _node->_x);
-        mkdirs(b3dm_file);
-        // fix the box 
-        {
-            OGREnvelope node_box;
-            for (auto id : _node->get_ids()) {
-                OGRFeature *poFeature = poLayer->GetFeature(id);
-                OGRGeometry* poGeometry = poFeature->GetGeometryRef();
-                OGREnvelope geo_box;
-                poGeometry->getEnvelope(&geo_box);
-                if ( !node_box.IsInit() ) {
-                    node_box = geo_box;
-                }
-                else {
-                    node_box.Merge(geo_box);
-                }
-            }
-            _node->_box.minx = node_box.MinX;
-            _node->_box.maxx = node_box.MaxX;
-            _node->_box.miny = node_box.MinY;
-            _node->_box.maxy = node_box.MaxY;
-        }
-        double center_x = ( _node->_box.minx + _node->_box.maxx ) / 2;
-        double center_y = ( _node->_box.miny + _node->_box.maxy ) / 2;
-        double max_height = 0;
-        std::vector<Polygon_Mesh> v_meshes;
-        for (auto id : _node->get_ids()) {
-            OGRFeature *poFeature = poLayer->GetFeature(id);
-            OGRGeometry *poGeometry;
-            poGeometry = poFeature->GetGeometryRef();
-            double height = 50.0;
-            if( field_index >= 0 ) {
-                height = poFeature->GetFieldAsDouble(field_index);
-            }
-            if (height > max_height) {
-                max_height = height;
-            }
-            if (wkbFlatten(poGeometry->getGeometryType()) == wkbPolygon) {
-                OGRPolygon* polyon = (OGRPolygon*)poGeometry;
-                Polygon_Mesh mesh = convert_polygon(polyon, center_x, center_y, height);
-                mesh.mesh_name = "mesh_" + std::to_string(id);
-                mesh.height = height;
-                v_meshes.push_back(mesh);
-            }
-            else if (wkbFlatten(poGeometry->getGeometryType()) == wkbMultiPolygon) {
-                OGRMultiPolygon* _multi = (OGRMultiPolygon*)poGeometry;
-                int sub_count = _multi->getNumGeometries();
-                for (int j = 0; j < sub_count; j++) {
-                    OGRPolygon * polyon = (OGRPolygon*)_multi->getGeometryRef(j);
-                    Polygon_Mesh mesh = convert_polygon(polyon, center_x, center_y, height);
-                    mesh.mesh_name = "mesh_" + std::to_string(id);
-                    mesh.height = height;
-                    v_meshes.push_back(mesh);
-                }
-            }
-            OGRFeature::DestroyFeature(poFeature);
-        }
-
-        sprintf(b3dm_file, "%s\\tile\\%d\\%d\\%d.b3dm", dest, _node->_z, _node->_x, _node->_y);
-        std::string b3dm_buf = make_b3dm(v_meshes, true);
-        write_file(b3dm_file, b3dm_buf.data(), b3dm_buf.size());
-        // test
-        //sprintf(b3dm_file, "%s\\tile\\%d\\%d\\%d.glb", dest, _node->_z, _node->_x, _node->_y);
-        //std::string glb_buf = make_polymesh(v_meshes);
-        //write_file(b3dm_file, glb_buf.data(), glb_buf.size());
-        //
-
-        char b3dm_name[512], tile_json_path[512];
-        sprintf(b3dm_name,"./tile/%d/%d/%d.b3dm",_node->_z,_node->_x,_node->_y);
-        sprintf(tile_json_path, "%s\\tile\\%d\\%d\\%d.json", dest, _node->_z, _node->_x, _node->_y);
-        double box_width = ( _node->_box.maxx - _node->_box.minx )  ;
-        double box_height = ( _node->_box.maxy - _node->_box.miny ) ;
-        const double pi = std::acos(-1);
-        double radian_x = degree2rad(center_x);
-        double radian_y = degree2rad(center_y);
-        write_tileset(radian_x, radian_y, 
-            longti_to_meter(degree2rad(box_width) * 1.05, radian_y),
-            lati_to_meter(degree2rad(box_height)  * 1.05),
-            0 , max_height, 100,
-            b3dm_name,tile_json_path);
-    }
+    // iter all node and convert to b3dm
+    ShpBuildState shpState;
+    shpState.layer = poLayer;
+    shpState.field_index = field_index;
+    shpState.options.dest = dest;
+    shpState.options.fields = read_batch_fields(poLayer, fields);
+    shpState.options.implicit = implicit;
+    shpState.options.clip = clip;
+    shpState.options.glb = glb;
+    std::vector<Footprint> footprints;
+    double max_height = 0;
+    make_node_tile(&root, &shpState, footprints, max_height);
     //
     GDALClose(poDS);
-    return true;
+    if (shpState.tiles.empty()) {
+        LOG_E("no tile in [%s]", filename);
+        return NULL;
+    }
+    void* buf = malloc(shpState.tiles.size() * sizeof(ShpTile));
+    memcpy(buf, shpState.tiles.data(), shpState.tiles.size() * sizeof(ShpTile));
+    *len = shpState.tiles.size();
+    return buf;
 #else
-    return false;
+    return NULL;
 #endif
 }
 
@@ -567,9 +1060,6 @@ void alignment_buffer(std::vector<T>& buf) {
     }
 }
 
-#define SET_MIN(x,v) do{ if (x > v) x = v; }while (0);
-#define SET_MAX(x,v) do{ if (x < v) x = v; }while (0);
-
 tinygltf::Material make_color_material(double r, double g, double b) {
     tinygltf::Material material;
     char buf[512];
@@ -587,181 +1077,299 @@ tinygltf::Material make_color_material(double r, double g, double b) {
     return material;
 }
 
-// convert poly-mesh to glb buffer
-std::string make_polymesh(std::vector<Polygon_Mesh>& meshes) {
-    vector<osg::ref_ptr<osg::Geometry>> osg_Geoms;
+// append the array to buffer without per element copy
+template<class T>
+void put_array(std::vector<unsigned char>& buf, const std::vector<T>& arr) {
+    buf.insert(buf.end(), (unsigned char*)arr.data(), (unsigned char*)(arr.data() + arr.size()));
+}
+
+// write indices of the batched features as one list, offset by each
+// feature's first vertex; uint16 if the vertex count fits, otherwise uint32
+template<class T>
+int write_batch_indices(std::vector<Polygon_Mesh>& meshes, std::vector<int>& ids, tinygltf::Buffer& buffer, int& max_idx) {
+    max_idx = 0;
+    int base = 0;
+    for (int id : ids) {
+        Polygon_Mesh& mesh = meshes[id];
+        for (auto& tri : mesh.index) {
+            for (int k = 0; k < 3; k++) {
+                put_val(buffer.data, (T)(base + tri[k]));
+                SET_MAX(max_idx, base + tri[k]);
+            }
+        }
+        base += mesh.vertex.size();
+    }
+    return sizeof(T) == 2 ? TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT : TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT;
+}
+
+// EXT_structural_metadata property table of the features,
+// the columns are appended to buffer as bufferViews
+std::string make_property_table(tinygltf::Model& model, tinygltf::Buffer& buffer,
+    std::vector<Polygon_Mesh>& meshes, const std::vector<BatchField>& fields)
+{
+    using nlohmann::json;
+    // the metadata views must start at 8 byte boundary
+    auto add_view = [&](const unsigned char* data, size_t len) -> int {
+        while (buffer.data.size() % 8 != 0) {
+            buffer.data.push_back(0x00);
+        }
+        tinygltf::BufferView bfv;
+        bfv.buffer = 0;
+        bfv.byteOffset = buffer.data.size();
+        bfv.byteLength = len;
+        buffer.data.insert(buffer.data.end(), data, data + len);
+        model.bufferViews.push_back(bfv);
+        return model.bufferViews.size() - 1;
+    };
+    auto add_numbers = [&](const void* data, size_t len) -> json {
+        return { { "values", add_view((const unsigned char*)data, len) } };
+    };
+    auto add_strings = [&](const std::vector<std::string>& texts) -> json {
+        std::string data;
+        std::vector<unsigned int> offsets = { 0 };
+        for (auto& text : texts) {
+            data += text;
+            offsets.push_back(data.size());
+        }
+        return {
+            { "values", add_view((const unsigned char*)data.data(), data.size()) },
+            { "stringOffsets", add_view((const unsigned char*)offsets.data(), offsets.size() * 4) },
+            { "stringOffsetType", "UINT32" }
+        };
+    };
+
+    json class_props, table_props;
+    std::vector<std::string> names;
+    std::vector<float> heights;
     for (auto& mesh : meshes) {
-        osg_Geoms.push_back(make_triangle_mesh(mesh));
+        names.push_back(mesh.mesh_name);
+        heights.push_back(mesh.height);
+    }
+    class_props["name"] = { { "type", "STRING" } };
+    table_props["name"] = add_strings(names);
+    class_props["height"] = { { "type", "SCALAR" }, { "componentType", "FLOAT32" } };
+    table_props["height"] = add_numbers(heights.data(), heights.size() * sizeof(float));
+
+    for (int f = 0; f < fields.size(); f++) {
+        const BatchField& field = fields[f];
+        // merged features have no attribute
+        auto has_value = [&](int i) { return f < meshes[i].attributes.size(); };
+        if (field.type == FIELD_STRING) {
+            std::vector<std::string> texts;
+            for (int i = 0; i < meshes.size(); ++i) {
+                texts.push_back(has_value(i) ? meshes[i].attributes[f].text : "");
+            }
+            class_props[field.name] = { { "type", "STRING" } };
+            table_props[field.name] = add_strings(texts);
+        }
+        else if (field.type == FIELD_INT) {
+            std::vector<int> values;
+            for (int i = 0; i < meshes.size(); ++i) {
+                values.push_back(has_value(i) ? (int)meshes[i].attributes[f].number : 0);
+            }
+            class_props[field.name] = { { "type", "SCALAR" }, { "componentType", "INT32" } };
+            table_props[field.name] = add_numbers(values.data(), values.size() * sizeof(values[0]));
+        }
+        else {
+            std::vector<double> values;
+            for (int i = 0; i < meshes.size(); ++i) {
+                values.push_back(has_value(i) ? meshes[i].attributes[f].number : 0);
+            }
+            class_props[field.name] = { { "type", "SCALAR" }, { "componentType", "FLOAT64" } };
+            table_props[field.name] = add_numbers(values.data(), values.size() * sizeof(values[0]));
+        }
     }
+    json ext;
+    ext["EXT_structural_metadata"] = {
+        { "schema", { { "classes", { { "feature", { { "properties", class_props } } } } } } },
+        { "propertyTables", { {
+            { "class", "feature" },
+            { "count", meshes.size() },
+            { "properties", table_props }
+        } } }
+    };
+    return ext.dump();
+}
+
+// convert poly-mesh to glb buffer
+// all features of the tile go into one primitive per material,
+// the _BATCHID attribute tells the features apart.
+// with metadata the glb is the tile content itself, the features are
+// given by EXT_mesh_features and EXT_structural_metadata instead.
+// y_up turns the z-up mesh to the y-up of glTF, as the glb content of
+// 3D Tiles 1.1 has no gltfUpAxis, the b3dm keep theirs
+std::string make_polymesh(std::vector<Polygon_Mesh>& meshes,
+    const std::vector<BatchField>* metadata, double* rtc_center, bool y_up) {
     tinygltf::TinyGLTF gltf;
     tinygltf::Model model;
     // model.name = model_name;
     // only one buffer
     tinygltf::Buffer buffer;
-    // buffer_view {index,vertex,normal(texcoord,image)}
-    uint32_t buf_offset = 0;
-    auto calc_offset = [&]() -> int{
-        return buffer.data.size() - buf_offset;
-    };
-    uint32_t acc_offset[4] = {0,0,0,0};
+
+    bool use_multi_material = false;
+    // material -> feature ids, the batch id is the index in meshes
+    std::map<int, std::vector<int>> batches;
+    for (int i = 0; i < meshes.size(); i++) {
+        if (meshes[i].index.empty()) continue;
+        batches[use_multi_material ? i : 0].push_back(i);
+    }
+    // unsigned short can not hold all batch ids
+    bool float_batch_id = meshes.size() > 65535;
+
+    // buffer_view {index,vertex,normal,batchid}
+    std::vector<std::vector<int>> accessors(4);
     int buf_times = 4;
     for (int j = 0; j < buf_times; j++)
     {
-        for (int i = 0; i < meshes.size(); i++) {
-            if (osg_Geoms[i]->getNumPrimitiveSets() == 0) continue;
+        unsigned buf_offset = buffer.data.size();
+        for (auto& batch : batches) {
+            std::vector<int>& ids = batch.second;
+            size_t vertex_count = 0;
+            size_t index_count = 0;
+            for (int id : ids) {
+                vertex_count += meshes[id].vertex.size();
+                index_count += meshes[id].index.size() * 3;
+            }
+            tinygltf::Accessor acc;
+            acc.bufferView = j;
+            acc.byteOffset = buffer.data.size() - buf_offset;
             if (j == 0) {
                 // indc
-                osg::PrimitiveSet* ps = osg_Geoms[i]->getPrimitiveSet(0);
-                int idx_size = ps->getNumIndices();
                 int max_idx = 0;
-
-                const osg::DrawElementsUShort* drawElements = static_cast<const osg::DrawElementsUShort*>(ps);
-                int IndNum = drawElements->getNumIndices();
-                for (int m = 0; m < IndNum; m++)
-                {
-                    unsigned short idx = drawElements->at(m);
-                    put_val(buffer.data, idx);
-                    SET_MAX(max_idx, idx);
+                if (vertex_count > 65535) {
+                    acc.componentType = write_batch_indices<uint32_t>(meshes, ids, buffer, max_idx);
+                } else {
+                    acc.componentType = write_batch_indices<uint16_t>(meshes, ids, buffer, max_idx);
                 }
-                    
-                tinygltf::Accessor acc;
-                acc.bufferView = 0;
-                acc.byteOffset = acc_offset[j];
-                alignment_buffer(buffer.data);
-                acc_offset[j] = calc_offset();
-                acc.componentType = TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT;
-                acc.count = idx_size;
+                acc.count = index_count;
                 acc.type = TINYGLTF_TYPE_SCALAR;
                 acc.maxValues = { (double)max_idx };
                 acc.minValues = { 0.0 };
-                model.accessors.push_back(acc);
             }else if ( j == 1) {
-                osg::Array* va = osg_Geoms[i]->getVertexArray();
-                osg::Vec3Array* v3f = (osg::Vec3Array*)va;
-                int vec_size = v3f->size();
                 std::vector<double> box_max = { -1e38, -1e38 ,-1e38 };
                 std::vector<double> box_min = { 1e38, 1e38 ,1e38 };
-                for (int vidx = 0; vidx < vec_size; vidx++) {
-                    osg::Vec3f point = v3f->at(vidx);
-                    vector<float> vertex = { point.x(), point.y(), point.z()};
-                    for (int i = 0; i < 3; i++)
-                    {
-                        put_val(buffer.data, vertex[i]);
-                        SET_MAX(box_max[i], vertex[i]);
-                        SET_MIN(box_min[i], vertex[i]);
+                buffer.data.reserve(buffer.data.size() + vertex_count * 12);
+                for (int id : ids) {
+                    for (auto& vertex : meshes[id].vertex) {
+                        for (int k = 0; k < 3; k++)
+                        {
+                            SET_MAX(box_max[k], vertex[k]);
+                            SET_MIN(box_min[k], vertex[k]);
+                        }
                     }
+                    put_array(buffer.data, meshes[id].vertex);
                 }
-                tinygltf::Accessor acc;
-                acc.bufferView = 1;
-                acc.byteOffset = acc_offset[j];
-                alignment_buffer(buffer.data);
-                acc_offset[j] = calc_offset();
-                acc.count = vec_size;
+                acc.count = vertex_count;
                 acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
                 acc.type = TINYGLTF_TYPE_VEC3;
                 acc.maxValues = box_max;
                 acc.minValues = box_min;
-                model.accessors.push_back(acc);
             }else if ( j == 2) {
                 // normal
-                osg::Array* na = osg_Geoms[i]->getNormalArray();
-                if (!na) continue;
-                osg::Vec3Array* v3f = (osg::Vec3Array*)na;
-                std::vector<double> box_max = { -1e38, -1e38 ,-1e38 };
-                std::vector<double> box_min = { 1e38, 1e38 ,1e38 };
-                int normal_size = v3f->size();
-                for (int vidx = 0; vidx < normal_size; vidx++)
-                {
-                    osg::Vec3f point = v3f->at(vidx);
-                    vector<float> normal = { point.x(), point.y(), point.z() };
-                    
-                    for (int i = 0; i < 3; i++)
-                    {
-                        put_val(buffer.data, normal[i]);
-                        SET_MAX(box_max[i], normal[i]);
-                        SET_MIN(box_min[i], normal[i]);
+                buffer.data.reserve(buffer.data.size() + vertex_count * 12);
+                for (int id : ids) {
+                    Polygon_Mesh& mesh = meshes[id];
+                    if (mesh.normal.size() == mesh.vertex.size()) {
+                        put_array(buffer.data, mesh.normal);
+                    }
+                    else {
+                        // keep the attribute aligned with the vertex
+                        for (int k = 0; k < mesh.vertex.size(); k++) {
+                            put_val(buffer.data, 0.f);
+                            put_val(buffer.data, 0.f);
+                            put_val(buffer.data, 1.f);
+                        }
                     }
                 }
-                tinygltf::Accessor acc;
-                acc.bufferView = 2;
-                acc.byteOffset = acc_offset[j];
-                alignment_buffer(buffer.data);
-                acc_offset[j] = calc_offset();
-                acc.count = normal_size;
+                acc.count = vertex_count;
                 acc.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
                 acc.type = TINYGLTF_TYPE_VEC3;
-                acc.minValues = box_min;
-                acc.maxValues = box_max;
-                model.accessors.push_back(acc);
             }else if ( j == 3) {
                 // batch id
-                unsigned short batch_id = i;
-                for (auto& vertex : meshes[i].vertex) {
-                    put_val(buffer.data, batch_id);
+                for (int id : ids) {
+                    for (int k = 0; k < meshes[id].vertex.size(); k++) {
+                        if (float_batch_id) {
+                            put_val(buffer.data, (float)id);
+                        }
+                        else {
+                            put_val(buffer.data, (unsigned short)id);
+                        }
+                    }
                 }
-                tinygltf::Accessor acc;
-                acc.bufferView = 3;
-                acc.byteOffset = acc_offset[j];
-                alignment_buffer(buffer.data);
-                acc_offset[j] = calc_offset();
-                acc.componentType = TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT;
-                acc.count = meshes[i].vertex.size();
+                acc.componentType = float_batch_id ?
+                    TINYGLTF_COMPONENT_TYPE_FLOAT : TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT;
+                acc.count = vertex_count;
                 acc.type = TINYGLTF_TYPE_SCALAR;
-                acc.maxValues = { (double)i };
-                acc.minValues = { (double)batch_id };
-                model.accessors.push_back(acc);
+                acc.maxValues = { (double)ids.back() };
+                acc.minValues = { (double)ids.front() };
             }
+            alignment_buffer(buffer.data);
+            accessors[j].push_back(model.accessors.size());
+            model.accessors.push_back(acc);
         }
         tinygltf::BufferView bfv;
         bfv.buffer = 0;
-        if (j == 0 || j == 3) {
+        if (j == 0) {
             bfv.target = TINYGLTF_TARGET_ELEMENT_ARRAY_BUFFER;
         }
         else {
             bfv.target = TINYGLTF_TARGET_ARRAY_BUFFER;
-            bfv.byteStride = 4 * 3;
+            if (j != 3) {
+                bfv.byteStride = 4 * 3;
+            }
         }
         bfv.byteOffset = buf_offset;
-        alignment_buffer(buffer.data);
-        bfv.byteLength = calc_offset();
-        buf_offset = buffer.data.size();
+        bfv.byteLength = buffer.data.size() - buf_offset;
         model.bufferViews.push_back(bfv);
     }
 
-    bool use_multi_material = false;
-    for (int i = 0; i < meshes.size(); i++) {
-        tinygltf::Mesh mesh;
-        mesh.name = meshes[i].mesh_name;
+    tinygltf::Mesh mesh;
+    int batch_idx = 0;
+    for (auto& batch : batches) {
         tinygltf::Primitive primits;
         primits.attributes = { 
-            std::pair<std::string,int>("POSITION", 1 * meshes.size() + i),
-            std::pair<std::string,int>("NORMAL",   2 * meshes.size() + i),
-            std::pair<std::string,int>("_BATCHID", 3 * meshes.size() + i),
+            std::pair<std::string,int>("POSITION", accessors[1][batch_idx]),
+            std::pair<std::string,int>("NORMAL",   accessors[2][batch_idx]),
+            std::pair<std::string,int>(metadata ? "_FEATURE_ID_0" : "_BATCHID", accessors[3][batch_idx]),
         };
-        primits.indices = i;
+        if (metadata) {
+            char buf[256];
+            sprintf(buf, "{\"EXT_mesh_features\":{\"featureIds\":[{\"featureCount\":%d,\"attribute\":0,\"propertyTable\":0}]}}",
+                (int)batch.second.size());
+            primits.extensions_json = buf;
+        }
+        primits.indices = accessors[0][batch_idx];
         if(use_multi_material) {
             //TODO: turn height to rgb(r,g,b)
             tinygltf::Material material =  make_color_material(1.0, 0.0, 0.0);
+            primits.material = model.materials.size();
             model.materials.push_back(material);
-            primits.material = i;
         } else {
             primits.material = 0;
         }
         primits.mode = TINYGLTF_MODE_TRIANGLES;
-        mesh.primitives = {
-            primits
-        };
-        model.meshes.push_back(mesh);
+        mesh.primitives.push_back(primits);
+        batch_idx++;
     }
 
-    for (int i = 0; i < meshes.size(); i++) {
+    tinygltf::Scene sence;
+    if (!mesh.primitives.empty()) {
+        model.meshes.push_back(std::move(mesh));
         tinygltf::Node node;
-        node.mesh = i;
+        node.mesh = 0;
+        if (rtc_center) {
+            node.translation = { rtc_center[0], rtc_center[1], rtc_center[2] };
+        }
+        if (y_up) {
+            // -90 degrees around x: (x, y, z) -> (x, z, -y), the translation
+            // is applied after the rotation so it is turned too
+            node.rotation = { -0.70710678118654752, 0, 0, 0.70710678118654752 };
+            if (rtc_center) {
+                node.translation = { rtc_center[0], rtc_center[2], -rtc_center[1] };
+            }
+        }
         model.nodes.push_back(node);
-    }
-    tinygltf::Scene sence;
-    for (int i = 0; i < meshes.size(); i++) {
-        sence.nodes.push_back(i);
+        sence.nodes.push_back(0);
     }
     model.scenes = { sence };
     model.defaultScene = 0;
@@ -793,6 +1401,10 @@ std::string make_polymesh(std::vector<Polygon_Mesh>& meshes) {
         model.materials = { material };
     }
 
+    if (metadata) {
+        model.extensions_json = make_property_table(model, buffer, meshes, *metadata);
+        model.extensionsUsed = { "EXT_mesh_features", "EXT_structural_metadata" };
+    }
     model.buffers.push_back(std::move(buffer));
     model.asset.version = "2.0";
     model.asset.generator = "fanfan";
@@ -801,41 +1413,90 @@ std::string make_polymesh(std::vector<Polygon_Mesh>& meshes) {
     return buf;
 }
 
-std::string make_b3dm(std::vector<Polygon_Mesh>& meshes, bool with_height = false) {
+// pad with space, the next section starts at 8 byte boundary of the file
+void pad_to_8(std::string& buf, size_t offset, char pad = ' ') {
+    while ((offset + buf.size()) % 8 != 0) {
+        buf.push_back(pad);
+    }
+}
+
+// numeric column in the batch table binary body
+template<class T>
+void put_batch_column(nlohmann::json& batch_json, std::string& batch_bin,
+    const std::string& name, const char* component_type, const std::vector<T>& values) {
+    pad_to_8(batch_bin, 0, 0x00);
+    batch_json[name] = {
+        { "byteOffset", batch_bin.size() },
+        { "componentType", component_type },
+        { "type", "SCALAR" }
+    };
+    batch_bin.append((const char*)values.data(), values.size() * sizeof(T));
+}
+
+std::string make_b3dm(std::vector<Polygon_Mesh>& meshes, const std::vector<BatchField>& fields, double* rtc_center) {
     using nlohmann::json;
     
     std::string feature_json_string;
     feature_json_string += "{\"BATCH_LENGTH\":";
     feature_json_string += std::to_string(meshes.size());
-    feature_json_string += "}";
-    while (feature_json_string.size() % 4 != 0 ) {
-        feature_json_string.push_back(' ');
+    if (rtc_center) {
+        char buf[256];
+        sprintf(buf, ",\"RTC_CENTER\":[%.9f,%.9f,%.9f]", rtc_center[0], rtc_center[1], rtc_center[2]);
+        feature_json_string += buf;
     }
+    feature_json_string += "}";
+    pad_to_8(feature_json_string, 28);
     
+    // numbers go to the binary body, strings stay in json
     json batch_json;
-    std::vector<int> ids;
+    std::string batch_bin;
+    std::vector<unsigned int> ids;
     for (int i = 0; i < meshes.size(); ++i) {
         ids.push_back(i);
     }
+    put_batch_column(batch_json, batch_bin, "batchId", "UNSIGNED_INT", ids);
     std::vector<std::string> names;
     for (int i = 0; i < meshes.size(); ++i) {
         names.push_back(meshes[i].mesh_name);
     }
-    batch_json["batchId"] = ids;
     batch_json["name"] = names;
 
-    if (with_height) {
-        std::vector<float> heights;
-        for (int i = 0; i < meshes.size(); ++i) {
-            heights.push_back(meshes[i].height);
+    std::vector<float> heights;
+    for (int i = 0; i < meshes.size(); ++i) {
+        heights.push_back(meshes[i].height);
+    }
+    put_batch_column(batch_json, batch_bin, "height", "FLOAT", heights);
+
+    for (int f = 0; f < fields.size(); f++) {
+        const BatchField& field = fields[f];
+        // merged features have no attribute
+        auto has_value = [&](int i) { return f < meshes[i].attributes.size(); };
+        if (field.type == FIELD_STRING) {
+            std::vector<std::string> texts;
+            for (int i = 0; i < meshes.size(); ++i) {
+                texts.push_back(has_value(i) ? meshes[i].attributes[f].text : "");
+            }
+            batch_json[field.name] = texts;
+        }
+        else if (field.type == FIELD_INT) {
+            std::vector<int> values;
+            for (int i = 0; i < meshes.size(); ++i) {
+                values.push_back(has_value(i) ? (int)meshes[i].attributes[f].number : 0);
+            }
+            put_batch_column(batch_json, batch_bin, field.name, "INT", values);
+        }
+        else {
+            std::vector<double> values;
+            for (int i = 0; i < meshes.size(); ++i) {
+                values.push_back(has_value(i) ? meshes[i].attributes[f].number : 0);
+            }
+            put_batch_column(batch_json, batch_bin, field.name, "DOUBLE", values);
         }
-        batch_json["height"] = heights;
     }
 
     std::string batch_json_string = batch_json.dump();
-    while (batch_json_string.size() % 4 != 0 ) {
-        batch_json_string.push_back(' ');
-    }
+    pad_to_8(batch_json_string, 28 + feature_json_string.size());
+    pad_to_8(batch_bin, 0, 0x00);
 
     std::string glb_buf = make_polymesh(meshes);
     // how length total ?
@@ -848,8 +1509,8 @@ std::string make_b3dm(std::vector<Polygon_Mesh>& meshes, bool with_height = fals
     int feature_json_len = feature_json_string.size();
     int feature_bin_len = 0;
     int batch_json_len = batch_json_string.size();
-    int batch_bin_len = 0;
-    int total_len = 28 /*header size*/ + feature_json_len + batch_json_len + glb_buf.size();
+    int batch_bin_len = batch_bin.size();
+    int total_len = 28 /*header size*/ + feature_json_len + batch_json_len + batch_bin_len + glb_buf.size();
     
     std::string b3dm_buf;
     b3dm_buf += "b3dm";
@@ -863,6 +1524,7 @@ std::string make_b3dm(std::vector<Polygon_Mesh>& meshes, bool with_height = fals
     //put_val(b3dm_buf, total_len);
     b3dm_buf.append(feature_json_string.begin(),feature_json_string.end());
     b3dm_buf.append(batch_json_string.begin(),batch_json_string.end());
+    b3dm_buf.append(batch_bin);
     b3dm_buf.append(glb_buf);
     return b3dm_buf;
 }
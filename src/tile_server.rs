@@ -0,0 +1,553 @@
+//! `--tile-server`: serve an osgb dataset as 3D Tiles, every tile is converted
+//! on its first request. Each osgb node gets its own small tileset.json made
+//! from the PagedLOD bounds, so nothing below the viewed tiles is read.
+//!
+//! GET /tileset.json                   the root, one child per Tile_
+//! GET /Data/Tile_xx/Tile_xx_L15_0.json the node and its children
+//! GET /Data/Tile_xx/Tile_xx_L15_0.b3dm the content (.glb with --glb)
+//! GET /metrics                        cache hits and cold tile latency
+
+extern crate libc;
+extern crate rayon;
+
+use std::collections::{BTreeMap, HashMap};
+use std::fs;
+use std::io;
+use std::net::TcpStream;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+use std::time::{Instant, UNIX_EPOCH};
+
+use http::{respond, respond_json, Request};
+use osgb::{
+    mesh_stats, set_mesh_options, set_task_threads, set_texture_options, texture_bytes,
+    texture_cache_stats, MemBudget, OsgbConfig,
+};
+
+extern "C" {
+    fn osgb23dtile_buf(name_in: *const u8, len: *mut i32) -> *mut libc::c_void;
+
+    fn osgb_content_options(pbr_texture: bool, glb_content: bool);
+
+    fn osgb_node_json(name_in: *const u8, len: *mut i32) -> *mut libc::c_void;
+
+    fn transform_c(radian_x: f64, radian_y: f64, height_min: f64, ptr: *mut f64);
+}
+
+fn c_path(path: &Path) -> Vec<u8> {
+    let mut buf = path.to_string_lossy().as_bytes().to_vec();
+    buf.push(0x00);
+    buf
+}
+
+unsafe fn take_c_buf(ptr: *mut libc::c_void, len: i32) -> Option<Vec<u8>> {
+    if ptr.is_null() {
+        return None;
+    }
+    let buf = ::std::slice::from_raw_parts(ptr as *const u8, len as usize).to_vec();
+    libc::free(ptr);
+    Some(buf)
+}
+
+// least recently used first out, size bounded
+struct Lru<V> {
+    cap: u64,
+    used: u64,
+    tick: u64,
+    items: HashMap<String, (V, u64, u64)>,
+    order: BTreeMap<u64, String>,
+}
+
+impl<V: Clone> Lru<V> {
+    fn new(cap: u64) -> Lru<V> {
+        Lru {
+            cap: cap,
+            used: 0,
+            tick: 0,
+            items: HashMap::new(),
+            order: BTreeMap::new(),
+        }
+    }
+
+    fn get(&mut self, key: &str) -> Option<V> {
+        self.tick += 1;
+        let tick = self.tick;
+        let item = self.items.get_mut(key)?;
+        self.order.remove(&item.2);
+        item.2 = tick;
+        self.order.insert(tick, key.to_string());
+        Some(item.0.clone())
+    }
+
+    // returns the evicted items
+    fn insert(&mut self, key: String, value: V, size: u64) -> Vec<(String, V)> {
+        self.tick += 1;
+        if let Some(old) = self.items.remove(&key) {
+            self.order.remove(&old.2);
+            self.used -= old.1;
+        }
+        self.order.insert(self.tick, key.clone());
+        self.items.insert(key, (value, size, self.tick));
+        self.used += size;
+        let mut evicted = vec![];
+        while self.used > self.cap && self.items.len() > 1 {
+            let (&tick, _) = self.order.iter().next().unwrap();
+            let key = self.order.remove(&tick).unwrap();
+            let (v, size, _) = self.items.remove(&key).unwrap();
+            self.used -= size;
+            evicted.push((key, v));
+        }
+        evicted
+    }
+}
+
+// at most `count` conversions at once, the others wait for a slot
+struct Slots {
+    free: Mutex<usize>,
+    cond: Condvar,
+}
+
+impl Slots {
+    fn new(count: usize) -> Slots {
+        Slots {
+            free: Mutex::new(count.max(1)),
+            cond: Condvar::new(),
+        }
+    }
+
+    fn acquire(&self) {
+        let mut free = self.free.lock().unwrap();
+        while *free == 0 {
+            free = self.cond.wait(free).unwrap();
+        }
+        *free -= 1;
+    }
+
+    fn release(&self) {
+        *self.free.lock().unwrap() += 1;
+        self.cond.notify_one();
+    }
+}
+
+// the first request of a tile converts it, the others wait for its result
+struct Flight {
+    result: Mutex<Option<Option<Arc<Vec<u8>>>>>,
+    cond: Condvar,
+}
+
+#[derive(Default)]
+struct Metrics {
+    requests: AtomicUsize,
+    memory_hits: AtomicUsize,
+    disk_hits: AtomicUsize,
+    waits: AtomicUsize,
+    conversions: AtomicUsize,
+    failures: AtomicUsize,
+    // microseconds of the requests which converted a tile
+    cold_count: AtomicUsize,
+    cold_total_us: AtomicUsize,
+    cold_max_us: AtomicUsize,
+}
+
+struct TileServer {
+    dir: PathBuf,
+    cache_dir: PathBuf,
+    center_x: f64,
+    center_y: f64,
+    region_offset: Option<f64>,
+    glb_content: bool,
+    // every connection has its own thread, the conversions are bounded
+    // by the cores and the memory budget
+    slots: Slots,
+    budget: MemBudget,
+    memory: Mutex<Lru<Arc<Vec<u8>>>>,
+    disk: Mutex<Lru<()>>,
+    inflight: Mutex<HashMap<String, Arc<Flight>>>,
+    metrics: Metrics,
+}
+
+fn sphere(val: &::serde_json::Value) -> Vec<f64> {
+    val.as_array()
+        .map(|v| v.iter().map(|x| x.as_f64().unwrap_or(0.0)).collect())
+        .unwrap_or(vec![0.0; 4])
+}
+
+impl TileServer {
+    // the glb of 1.1 are y-up, only the b3dm have a gltfUpAxis
+    fn asset(&self) -> ::serde_json::Value {
+        if self.glb_content {
+            json!({ "version": "1.1" })
+        } else {
+            json!({ "version": "1.0", "gltfUpAxis": "Z" })
+        }
+    }
+
+    fn content_ext(&self) -> &'static str {
+        if self.glb_content {
+            "glb"
+        } else {
+            "b3dm"
+        }
+    }
+
+    fn node_info(&self, osgb: &Path) -> Option<::serde_json::Value> {
+        let mut len = 0i32;
+        let buf = unsafe { take_c_buf(osgb_node_json(c_path(osgb).as_ptr(), &mut len), len)? };
+        ::serde_json::from_slice(&buf).ok()
+    }
+
+    fn root_tileset(&self) -> Option<Vec<u8>> {
+        let mut children = vec![];
+        let mut spheres = vec![];
+        let mut names: Vec<String> = fs::read_dir(self.dir.join("Data"))
+            .ok()?
+            .filter_map(|e| e.ok())
+            .filter(|e| e.path().is_dir())
+            .map(|e| e.file_name().to_string_lossy().into_owned())
+            .collect();
+        names.sort();
+        for name in names {
+            let osgb = self.dir.join("Data").join(&name).join(&name).with_extension("osgb");
+            let info = match self.node_info(&osgb) {
+                Some(info) => info,
+                None => continue,
+            };
+            let s = sphere(&info["sphere"]);
+            children.push(json!({
+                "boundingVolume": { "sphere": s },
+                "geometricError": s[3] / 10.0,
+                "content": { "uri": format!("./Data/{}/{}.json", name, name) }
+            }));
+            spheres.push(s);
+        }
+        if spheres.is_empty() {
+            return None;
+        }
+        // a sphere around all the Tile_
+        let n = spheres.len() as f64;
+        let mut center = [0f64; 3];
+        for s in &spheres {
+            for i in 0..3 {
+                center[i] += s[i] / n;
+            }
+        }
+        let mut radius = 0f64;
+        let mut min_z = 1e38f64;
+        for s in &spheres {
+            let d = ((s[0] - center[0]).powi(2) + (s[1] - center[1]).powi(2) + (s[2] - center[2]).powi(2)).sqrt();
+            radius = radius.max(d + s[3]);
+            min_z = min_z.min(s[2] - s[3]);
+        }
+        let tras_height = self.region_offset.map_or(0.0, |v| v - min_z);
+        let mut trans_vec = vec![0f64; 16];
+        unsafe {
+            transform_c(self.center_x, self.center_y, tras_height, trans_vec.as_mut_ptr());
+        }
+        let root = json!({
+            "asset": self.asset(),
+            "geometricError": 2000,
+            "root": {
+                "transform": trans_vec,
+                "boundingVolume": { "sphere": [center[0], center[1], center[2], radius] },
+                "geometricError": 2000,
+                "children": children
+            }
+        });
+        ::serde_json::to_vec(&root).ok()
+    }
+
+    // the node with its content and one external tileset per child
+    fn node_tileset(&self, osgb: &Path) -> Option<Vec<u8>> {
+        let info = self.node_info(osgb)?;
+        let stem = osgb.file_stem()?.to_string_lossy().into_owned();
+        let s = sphere(&info["sphere"]);
+        let empty = vec![];
+        let list = info["children"].as_array().unwrap_or(&empty);
+        let error = if list.is_empty() { 0.0 } else { s[3] / 10.0 };
+        let children: Vec<_> = list
+            .iter()
+            .map(|c| {
+                let cs = sphere(&c["sphere"]);
+                let file = c["file"].as_str().unwrap_or("");
+                let name = Path::new(file).file_stem().map(|x| x.to_string_lossy().into_owned());
+                json!({
+                    "boundingVolume": { "sphere": cs },
+                    "geometricError": (cs[3] / 10.0).min(error / 2.0),
+                    "content": { "uri": format!("./{}.json", name.unwrap_or_default()) }
+                })
+            })
+            .collect();
+        let tileset = json!({
+            "asset": self.asset(),
+            "geometricError": error,
+            "root": {
+                "boundingVolume": { "sphere": s },
+                "geometricError": error,
+                "refine": "REPLACE",
+                "content": { "uri": format!("./{}.{}", stem, self.content_ext()) },
+                "children": children
+            }
+        });
+        ::serde_json::to_vec(&tileset).ok()
+    }
+
+    fn convert(&self, key: &str) -> Option<Vec<u8>> {
+        if key == "tileset.json" {
+            return self.root_tileset();
+        }
+        let path = Path::new(key);
+        let osgb = self.dir.join(path).with_extension("osgb");
+        match path.extension().and_then(|e| e.to_str()) {
+            Some("json") => self.node_tileset(&osgb),
+            Some(ext) if ext == self.content_ext() => {
+                let size = fs::metadata(&osgb).map(|m| m.len()).unwrap_or(0);
+                self.slots.acquire();
+                let textures = texture_bytes(&osgb);
+                let admitted = self.budget.acquire(self.budget.estimate(size, textures));
+                let mut len = 0i32;
+                let buf = unsafe { osgb23dtile_buf(c_path(&osgb).as_ptr(), &mut len) };
+                let buf = unsafe { take_c_buf(buf, len) };
+                self.budget.release(admitted, size, textures, 0);
+                self.slots.release();
+                self.metrics.conversions.fetch_add(1, Ordering::SeqCst);
+                buf
+            }
+            _ => None,
+        }
+    }
+
+    // the disk cache, else convert and keep it on disk,
+    // the flag is set if it was converted
+    fn load(&self, key: &str) -> (Option<Vec<u8>>, bool) {
+        let file = self.cache_dir.join(key);
+        if let Ok(buf) = fs::read(&file) {
+            self.metrics.disk_hits.fetch_add(1, Ordering::SeqCst);
+            let mut disk = self.disk.lock().unwrap();
+            if disk.get(key).is_none() {
+                self.evict_disk(disk.insert(key.to_string(), (), buf.len() as u64));
+            }
+            return (Some(buf), false);
+        }
+        let buf = match self.convert(key) {
+            Some(buf) => buf,
+            None => return (None, true),
+        };
+        // a tile cut short by a crash would be served as a disk hit, it is
+        // written next to its place and renamed when complete
+        let mut tmp = file.as_os_str().to_owned();
+        tmp.push(".tmp");
+        let saved = file
+            .parent()
+            .map_or(Ok(()), |dir| fs::create_dir_all(dir))
+            .and_then(|_| fs::write(&tmp, &buf))
+            .and_then(|_| fs::rename(&tmp, &file));
+        match saved {
+            Ok(_) => {
+                let evicted = self.disk.lock().unwrap().insert(key.to_string(), (), buf.len() as u64);
+                self.evict_disk(evicted);
+            }
+            Err(e) => error!("{}: {}", file.display(), e),
+        }
+        (Some(buf), true)
+    }
+
+    // count the tiles of the earlier runs in the disk cache, oldest first,
+    // and drop the writes they left unfinished
+    fn scan_disk(&self) {
+        let mut files = vec![];
+        let mut dirs = vec![self.cache_dir.clone()];
+        while let Some(dir) = dirs.pop() {
+            let entries = match fs::read_dir(&dir) {
+                Ok(entries) => entries,
+                Err(_) => continue,
+            };
+            for entry in entries.filter_map(|e| e.ok()) {
+                let path = entry.path();
+                let meta = match entry.metadata() {
+                    Ok(meta) => meta,
+                    Err(_) => continue,
+                };
+                if meta.is_dir() {
+                    dirs.push(path);
+                    continue;
+                }
+                match path.extension().and_then(|e| e.to_str()) {
+                    Some("tmp") => {
+                        let _ = fs::remove_file(&path);
+                    }
+                    Some("json") | Some("b3dm") | Some("glb") => {
+                        let key = path.strip_prefix(&self.cache_dir).unwrap();
+                        let key = key.to_string_lossy().replace("\\", "/");
+                        let modified = meta.modified().unwrap_or(UNIX_EPOCH);
+                        files.push((modified, key, meta.len()));
+                    }
+                    _ => {}
+                }
+            }
+        }
+        files.sort();
+        let mut disk = self.disk.lock().unwrap();
+        for (_, key, size) in files {
+            let evicted = disk.insert(key, (), size);
+            self.evict_disk(evicted);
+        }
+        info!("disk cache: {} tiles, {} MB", disk.items.len(), disk.used >> 20);
+    }
+
+    fn evict_disk(&self, evicted: Vec<(String, ())>) {
+        for (key, _) in evicted {
+            let _ = fs::remove_file(self.cache_dir.join(key));
+        }
+    }
+
+    fn get(&self, key: &str) -> Option<Arc<Vec<u8>>> {
+        self.metrics.requests.fetch_add(1, Ordering::SeqCst);
+        if let Some(buf) = self.memory.lock().unwrap().get(key) {
+            self.metrics.memory_hits.fetch_add(1, Ordering::SeqCst);
+            return Some(buf);
+        }
+        let (flight, leader) = {
+            let mut inflight = self.inflight.lock().unwrap();
+            match inflight.get(key) {
+                Some(f) => (f.clone(), false),
+                None => {
+                    let f = Arc::new(Flight {
+                        result: Mutex::new(None),
+                        cond: Condvar::new(),
+                    });
+                    inflight.insert(key.to_string(), f.clone());
+                    (f, true)
+                }
+            }
+        };
+        if !leader {
+            self.metrics.waits.fetch_add(1, Ordering::SeqCst);
+            let mut result = flight.result.lock().unwrap();
+            while result.is_none() {
+                result = flight.cond.wait(result).unwrap();
+            }
+            return result.clone().unwrap();
+        }
+        let start = Instant::now();
+        let (buf, converted) = self.load(key);
+        let buf = buf.map(Arc::new);
+        // the tileset json are cheap, the latency of the content is the metric
+        if converted && !key.ends_with(".json") {
+            let d = start.elapsed();
+            let us = d.as_secs() as usize * 1_000_000 + d.subsec_nanos() as usize / 1000;
+            self.metrics.cold_count.fetch_add(1, Ordering::SeqCst);
+            self.metrics.cold_total_us.fetch_add(us, Ordering::SeqCst);
+            store_max(&self.metrics.cold_max_us, us);
+            info!("{}: converted in {} ms", key, us / 1000);
+        }
+        match buf {
+            Some(ref b) => {
+                self.memory.lock().unwrap().insert(key.to_string(), b.clone(), b.len() as u64);
+            }
+            None => {
+                self.metrics.failures.fetch_add(1, Ordering::SeqCst);
+            }
+        }
+        *flight.result.lock().unwrap() = Some(buf.clone());
+        flight.cond.notify_all();
+        self.inflight.lock().unwrap().remove(key);
+        buf
+    }
+
+    fn metrics(&self) -> ::serde_json::Value {
+        let m = &self.metrics;
+        let load = |v: &AtomicUsize| v.load(Ordering::SeqCst);
+        let cold_count = load(&m.cold_count);
+        let cold_avg_ms = if cold_count > 0 {
+            load(&m.cold_total_us) as f64 / cold_count as f64 / 1000.0
+        } else {
+            0.0
+        };
+        let (texture_hits, texture_misses) = texture_cache_stats();
+        let (mesh_in, mesh_out) = mesh_stats();
+        json!({
+            "requests": load(&m.requests),
+            "memory_hits": load(&m.memory_hits),
+            "disk_hits": load(&m.disk_hits),
+            "waits": load(&m.waits),
+            "conversions": load(&m.conversions),
+            "failures": load(&m.failures),
+            "cold_tiles": cold_count,
+            "cold_avg_ms": cold_avg_ms,
+            "cold_max_ms": load(&m.cold_max_us) as f64 / 1000.0,
+            "memory_bytes": self.memory.lock().unwrap().used,
+            "disk_bytes": self.disk.lock().unwrap().used,
+            "texture_hits": texture_hits,
+            "texture_misses": texture_misses,
+            "mesh_bytes_saved": mesh_in - mesh_out
+        })
+    }
+}
+
+fn store_max(a: &AtomicUsize, v: usize) {
+    let mut cur = a.load(Ordering::SeqCst);
+    while v > cur {
+        match a.compare_exchange(cur, v, Ordering::SeqCst, Ordering::SeqCst) {
+            Ok(_) => break,
+            Err(x) => cur = x,
+        }
+    }
+}
+
+fn handle(server: &TileServer, req: Request, stream: &mut TcpStream) -> io::Result<()> {
+    if req.method != "GET" {
+        return respond_json(stream, 405, &json!({ "error": "GET only" }));
+    }
+    let key = req.path.trim_start_matches('/').to_string();
+    if key == "metrics" {
+        return respond_json(stream, 200, &server.metrics());
+    }
+    if key.split('/').any(|p| p == "..") {
+        return respond_json(stream, 400, &json!({ "error": "bad path" }));
+    }
+    let content_type = if key.ends_with(".json") {
+        "application/json"
+    } else if key.ends_with(".glb") {
+        "model/gltf-binary"
+    } else {
+        "application/octet-stream"
+    };
+    let cors = [("Access-Control-Allow-Origin", "*")];
+    match server.get(&key) {
+        Some(buf) => respond(stream, 200, content_type, &cors, &buf),
+        None => respond(stream, 404, "text/plain", &cors, b"not found"),
+    }
+}
+
+/// serve dir, the converted tiles are cached in memory and in cache_dir
+pub fn run(
+    addr: &str,
+    dir: &Path,
+    cache_dir: &Path,
+    center_x: f64,
+    center_y: f64,
+    config: &OsgbConfig,
+) -> io::Result<()> {
+    let server = Arc::new(TileServer {
+        dir: dir.to_path_buf(),
+        cache_dir: cache_dir.to_path_buf(),
+        center_x: center_x,
+        center_y: center_y,
+        region_offset: config.region_offset,
+        glb_content: config.glb_content,
+        slots: Slots::new(rayon::current_num_threads()),
+        budget: MemBudget::new(config.mem_budget),
+        memory: Mutex::new(Lru::new(config.mem_cache.unwrap_or(1 << 30))),
+        disk: Mutex::new(Lru::new(config.disk_cache.unwrap_or(u64::max_value()))),
+        inflight: Mutex::new(HashMap::new()),
+        metrics: Metrics::default(),
+    });
+    fs::create_dir_all(cache_dir)?;
+    server.scan_disk();
+    set_texture_options(config);
+    set_mesh_options(config);
+    set_task_threads(rayon::current_num_threads());
+    unsafe { osgb_content_options(config.pbr_texture, config.glb_content) }
+    ::http::serve(addr, move |req, stream| handle(&server, req, stream))
+}
@@ -348,10 +348,17 @@ bool write_tileset(
     json_txt += std::to_string(region[5]);
 
     char last_buf[512];
-    sprintf(last_buf,"]},\"geometricError\": %f,\
+    if (filename && filename[0]) {
+        sprintf(last_buf,"]},\"geometricError\": %f,\
         \"refine\": \"REPLACE\",\
         \"content\": {\
         \"uri\": \"%s\"}}}", geometricError, filename);
+    }
+    else {
+        // node without content, only the children refine it
+        sprintf(last_buf,"]},\"geometricError\": %f,\
+        \"refine\": \"REPLACE\"}}", geometricError);
+    }
 
     json_txt += last_buf;
 
@@ -360,4 +367,21 @@ bool write_tileset(
         LOG_E("write file %s fail", filename);
     }
     return ret;
-}
\ No newline at end of file
+}
+
+// region and transform the same as write_tileset, but kept in memory
+void tile_region(
+    double radian_x, double radian_y,
+    double tile_w, double tile_h,
+    double height_min, double height_max,
+    double* region, double* matrix)
+{
+    std::vector<double> v = transfrom_xyz(radian_x, radian_y, height_min);
+    std::memcpy(matrix, v.data(), v.size() * sizeof(double));
+    region[0] = radian_x - meter_to_longti(tile_w / 2, radian_y);
+    region[1] = radian_y - meter_to_lati(tile_h / 2);
+    region[2] = radian_x + meter_to_longti(tile_w / 2, radian_y);
+    region[3] = radian_y + meter_to_lati(tile_h / 2);
+    region[4] = 0;
+    region[5] = height_max;
+}
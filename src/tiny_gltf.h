@@ -481,9 +481,10 @@ struct Image {
 struct Texture {
   int sampler;
   int source;  // Required (not specified in the spec ?)
+  int webp_source;  // EXT_texture_webp
   Value extras;
 
-  Texture() : sampler(-1), source(-1) {}
+  Texture() : sampler(-1), source(-1), webp_source(-1) {}
 };
 
 struct Shader {
@@ -639,6 +640,7 @@ struct Primitive {
   // "TANGENT"] pointing
   // to their corresponding accessors
   Value extras;
+  std::string extensions_json;  // raw json object, e.g. EXT_mesh_features
 
   Primitive() {
     material = -1;
@@ -759,6 +761,7 @@ class Model {
   Extension extensions;
   //
   int defaultScene;
+  std::string extensions_json;  // raw json object, e.g. EXT_structural_metadata
   std::vector<std::string> extensionsUsed;
   std::vector<std::string> extensionsRequired;
 
@@ -3561,6 +3564,10 @@ static void SerializeGltfMesh(Mesh &mesh, json &o) {
       primitive["targets"] = targets;
     }
 
+    if (gltfPrimitive.extensions_json.size()) {
+      primitive["extensions"] = json::parse(gltfPrimitive.extensions_json);
+    }
+
     primitives.push_back(primitive);
   }
 
@@ -3686,7 +3693,16 @@ static void SerializeGltfSkin(Skin &skin, json &o) {
 
 static void SerializeGltfTexture(Texture &texture, json &o) {
   SerializeNumberProperty("sampler", texture.sampler, o);
-  SerializeNumberProperty("source", texture.source, o);
+  if (texture.source >= 0) {
+    SerializeNumberProperty("source", texture.source, o);
+  }
+  if (texture.webp_source >= 0) { // use EXT_texture_webp
+    json webp;
+    SerializeNumberProperty("source", texture.webp_source, webp);
+    json extension;
+    extension["EXT_texture_webp"] = webp;
+    o["extensions"] = extension;
+  }
 
   if (texture.extras.Size()) {
     json extras;
@@ -3993,6 +4009,9 @@ std::string TinyGLTF::Serialize(Model *model) {
   // use extension
   // if (model->extensionsUsed.size())
   //   output["extensions"] = extensions;
+  if (model->extensions_json.size()) {
+    output["extensions"] = json::parse(model->extensions_json);
+  }
 
   // MESHES
   json meshes;